@@ -14,8 +14,17 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#define ring_calloc(n, size) kvcalloc(n, size, GFP_KERNEL)
+#define ring_free(ptr) kvfree(ptr)
 #else
 #include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#define ring_calloc(n, size) calloc(n, size)
+#define ring_free(ptr) free(ptr)
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -31,59 +40,117 @@
  * NULL if this position is not available in the buffer (not enough data is written).
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
-            size_t char_offset, size_t *entry_offset_byte_rtn )
+            uint64_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t total_offset = 0;
-    uint8_t current_offset = buffer->out_offs;
+    uint64_t target;
+    uint32_t count;
+    uint32_t low = 0;
+    uint32_t high;
+    uint32_t slot;
 
-    //Traverse entries
-    while(true)
+    //Lockless readers may see count and total_size disagree, check both so the search always terminates
+    count = aesd_circular_buffer_count(buffer);
+    if(count == 0 || char_offset >= buffer->total_size)
     {
-        //If full
-        if(!buffer->full && current_offset == buffer->in_offs)
+        return NULL;
+    }
+
+    //Binary search for the last entry starting at or before the target
+    target = buffer->base_offset + char_offset;
+    high = count - 1;
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low + 1) / 2;
+
+        if(buffer->entry_offset[(buffer->out_offs + mid) % buffer->capacity] <= target)
         {
-            return NULL;
+            low = mid;
         }
-
-        //If offset within entry
-        if(char_offset < (total_offset + buffer->entry[current_offset].size))
+        else
         {
-            *entry_offset_byte_rtn = char_offset - total_offset;
-            return &buffer->entry[current_offset];
+            high = mid - 1;
         }
+    }
 
-        total_offset += buffer->entry[current_offset].size;
-        current_offset = (current_offset + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    slot = (buffer->out_offs + low) % buffer->capacity;
+    *entry_offset_byte_rtn = target - buffer->entry_offset[slot];
+    return &buffer->entry[slot];
+}
 
-        //If wrapped and full
-        if(current_offset == buffer->out_offs && buffer->full)
-        {
-            return NULL;
-        }
+/**
+ * @param buffer the buffer to index.  Any necessary locking must be performed by caller.
+ * @param index the zero referenced entry to return, counted from the oldest entry in the buffer
+ * @param entry_fpos_rtn if not NULL, set to the position of the entry's first byte, in the same
+ *      coordinates as the char_offset of aesd_circular_buffer_find_entry_offset_for_fpos()
+ * @return the entry at @param index, or NULL if fewer entries are stored
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            uint32_t index, uint64_t *entry_fpos_rtn)
+{
+    uint32_t slot;
+
+    if(index >= aesd_circular_buffer_count(buffer))
+    {
+        return NULL;
+    }
+
+    slot = (buffer->out_offs + index) % buffer->capacity;
+    if(entry_fpos_rtn != NULL)
+    {
+        *entry_fpos_rtn = buffer->entry_offset[slot] - buffer->base_offset;
+    }
+    return &buffer->entry[slot];
+}
+
+/**
+* @return the number of entries currently stored in @param buffer
+*/
+uint32_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+    if(buffer->full)
+    {
+        return buffer->capacity;
     }
+    return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
 
-    // Shouldn't reach here
-    return NULL;
+/**
+* @return true if the oldest entry of @param buffer has to be evicted before an entry of
+* @param add_size bytes can be added, because the buffer is full or the entry would take
+* total_size past max_bytes.  An entry larger than max_bytes evicts every other entry.
+*/
+bool aesd_circular_buffer_must_evict(struct aesd_circular_buffer *buffer, size_t add_size)
+{
+    if(buffer->full)
+    {
+        return true;
+    }
+    return buffer->max_bytes != 0 && aesd_circular_buffer_count(buffer) > 0 &&
+           buffer->total_size + add_size > buffer->max_bytes;
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* First evicts as many of the oldest entries as aesd_circular_buffer_must_evict() requires,
+* advancing buffer->out_offs and moving buffer->base_offset past the evicted bytes.
+* Callers that own the memory of evicted entries should remove them with
+* aesd_circular_buffer_remove_entry() beforehand.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
 */
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-
-    //Overwrite oldest if full
-    if(buffer->full)
+    //Overwrite oldest if full or over the byte limit
+    while(aesd_circular_buffer_must_evict(buffer, add_entry->size))
     {
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        aesd_circular_buffer_remove_entry(buffer, NULL);
     }
 
+    buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry_offset[buffer->in_offs] = buffer->base_offset + buffer->total_size;
+    buffer->total_size += add_entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
+
     //Set full if wrapped
     if(buffer->in_offs == buffer->out_offs)
     {
@@ -92,9 +159,93 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Removes the oldest entry from @param buffer, moving buffer->base_offset past its bytes.
+* Any necessary locking must be handled by the caller
+* @param removed_entry if not NULL, set to the removed entry so the caller can release its memory
+* @return false if @param buffer was empty
+*/
+bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_entry)
+{
+    struct aesd_buffer_entry *oldest;
+
+    if(aesd_circular_buffer_count(buffer) == 0)
+    {
+        return false;
+    }
+
+    oldest = &buffer->entry[buffer->out_offs];
+    if(removed_entry != NULL)
+    {
+        *removed_entry = *oldest;
+    }
+    buffer->base_offset += oldest->size;
+    buffer->total_size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+    buffer->full = false;
+    return true;
+}
+
+/**
+* @return the number of bytes stored across all entries in @param buffer.
+* Any necessary locking must be handled by the caller
+*/
+uint64_t aesd_circular_buffer_total_size(struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
+}
+
+/**
+* Limits @param buffer to @param max_bytes bytes across all entries, on top of its entry capacity.
+* 0 removes the limit.  The limit is enforced as entries are added, entries already stored are
+* not evicted.
+*/
+void aesd_circular_buffer_set_max_bytes(struct aesd_circular_buffer *buffer, uint64_t max_bytes)
+{
+    buffer->max_bytes = max_bytes;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct with room
+* for @param capacity entries.
+* @return 0 on success, -EINVAL for a zero capacity or -ENOMEM if the entry array could not be allocated
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    if(capacity == 0)
+    {
+        return -EINVAL;
+    }
+
+    buffer->entry = ring_calloc(capacity, sizeof(struct aesd_buffer_entry));
+    buffer->entry_offset = ring_calloc(capacity, sizeof(uint64_t));
+    if(buffer->entry == NULL || buffer->entry_offset == NULL)
+    {
+        aesd_circular_buffer_free(buffer);
+        return -ENOMEM;
+    }
+    buffer->capacity = capacity;
+    return 0;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct with the
+* default capacity of AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
+*/
+int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+    return aesd_circular_buffer_init_capacity(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Releases the entry array allocated by aesd_circular_buffer_init_capacity().  Memory referenced
+* by the entries themselves is owned by the caller and must be freed first.
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
 {
+    ring_free(buffer->entry);
+    ring_free(buffer->entry_offset);
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 }
@@ -16,6 +16,9 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default ring capacity used by aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -33,18 +36,40 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of capacity pointers to memory allocated for the most recent write operations
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Absolute byte offset of the first byte of each element in entry, counted from the
+     * first byte ever added.  Used to binary search for a position.
+     */
+    uint64_t *entry_offset;
+    /**
+     * Number of elements allocated in entry and entry_offset
+     */
+    uint32_t capacity;
+    /**
+     * Absolute byte offset of the oldest entry still held, i.e. the number of bytes evicted so far
+     */
+    uint64_t base_offset;
+    /**
+     * Number of bytes held across all entries
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint64_t total_size;
+    /**
+     * Largest total_size allowed after adding an entry, 0 for no limit.
+     * See aesd_circular_buffer_set_max_bytes()
+     */
+    uint64_t max_bytes;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
@@ -52,20 +77,37 @@ struct aesd_circular_buffer
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
-            size_t char_offset, size_t *entry_offset_byte_rtn );
+            uint64_t char_offset, size_t *entry_offset_byte_rtn );
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
-extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+extern bool aesd_circular_buffer_must_evict(struct aesd_circular_buffer *buffer, size_t add_size);
+
+extern bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_entry);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            uint32_t index, uint64_t *entry_fpos_rtn);
+
+extern uint32_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer);
+
+extern uint64_t aesd_circular_buffer_total_size(struct aesd_circular_buffer *buffer);
+
+extern void aesd_circular_buffer_set_max_bytes(struct aesd_circular_buffer *buffer, uint64_t max_bytes);
+
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
 
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +116,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
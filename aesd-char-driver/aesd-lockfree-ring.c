@@ -0,0 +1,203 @@
+/**
+ * @file aesd-lockfree-ring.c
+ * @brief Lock-free history ring with sequence numbered entries, see aesd-lockfree-ring.h
+ *
+ * Producers claim a ticket with a single atomic increment, then the slot
+ * ticket % capacity with a compare and swap on its sequence value.  A
+ * producer that finds the slot already claimed by a later lap gives up: its
+ * entry is older than the whole ring and would have been evicted anyway.  The
+ * only wait is for an earlier lap's producer that is still copying into the
+ * slot.  Readers never wait and never write shared memory.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aesd-lockfree-ring.h"
+
+#define AESD_LOCKFREE_CACHE_LINE 64
+
+static struct aesd_lockfree_slot *aesd_lockfree_slot_for(struct aesd_lockfree_ring *ring, uint64_t ticket)
+{
+    return (struct aesd_lockfree_slot *)(ring->slots + (ticket & (ring->capacity - 1)) * ring->stride);
+}
+
+/**
+ * Initializes @param ring to an empty ring of @param capacity slots holding up to
+ * @param slot_size bytes each.
+ * @return 0 on success, -EINVAL if @param capacity is not a power of two or -ENOMEM
+ */
+int aesd_lockfree_ring_init(struct aesd_lockfree_ring *ring, uint32_t capacity, uint32_t slot_size)
+{
+    memset(ring, 0, sizeof(*ring));
+    if(capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        return -EINVAL;
+    }
+
+    //Round slots up to whole cache lines so producers of adjacent tickets don't share one
+    ring->stride = (sizeof(struct aesd_lockfree_slot) + slot_size + AESD_LOCKFREE_CACHE_LINE - 1) &
+                   ~(size_t)(AESD_LOCKFREE_CACHE_LINE - 1);
+    ring->slots = aligned_alloc(AESD_LOCKFREE_CACHE_LINE, ring->stride * capacity);
+    if(ring->slots == NULL)
+    {
+        return -ENOMEM;
+    }
+    memset(ring->slots, 0, ring->stride * capacity);
+    ring->capacity = capacity;
+    ring->slot_size = slot_size;
+    return 0;
+}
+
+/**
+ * Releases the slots allocated by aesd_lockfree_ring_init().  No thread may be using @param ring.
+ */
+void aesd_lockfree_ring_free(struct aesd_lockfree_ring *ring)
+{
+    free(ring->slots);
+    memset(ring, 0, sizeof(*ring));
+}
+
+/**
+ * Appends a copy of the @param size bytes at @param data, overwriting the oldest entry
+ * once @param ring holds capacity entries.  Safe to call from any number of threads.
+ * @return the ticket of the new entry, or -EMSGSIZE if @param size exceeds slot_size
+ */
+int64_t aesd_lockfree_ring_push(struct aesd_lockfree_ring *ring, const void *data, size_t size)
+{
+    struct aesd_lockfree_slot *slot;
+    uint64_t ticket;
+    uint64_t busy;
+    uint64_t seq;
+
+    if(size > ring->slot_size)
+    {
+        return -EMSGSIZE;
+    }
+
+    ticket = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    slot = aesd_lockfree_slot_for(ring, ticket);
+    busy = 2 * ticket + 1;
+
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        if(seq >= busy)
+        {
+            //A producer a lap ahead already took the slot, our entry was overwritten before anyone could read it
+            return ticket;
+        }
+        if(seq & 1)
+        {
+            //A producer a lap behind is still copying, it may be preempted so don't spin out our time slice
+            sched_yield();
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(__atomic_compare_exchange_n(&slot->seq, &seq, busy, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE); //Readers that see our data also see the odd seq
+    memcpy(slot->data, data, size);
+    __atomic_store_n(&slot->size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, busy + 1, __ATOMIC_RELEASE); //Publish
+    return ticket;
+}
+
+/**
+ * Copies the entry with ticket @param ticket to @param buf, of @param len bytes.
+ * @return the entry size, -EAGAIN if the entry is not published yet, -ENOENT if it has
+ * been overwritten, including while it was being copied, or -EMSGSIZE if @param len is too small
+ */
+ssize_t aesd_lockfree_ring_read(struct aesd_lockfree_ring *ring, uint64_t ticket, void *buf, size_t len)
+{
+    struct aesd_lockfree_slot *slot = aesd_lockfree_slot_for(ring, ticket);
+    uint64_t published = 2 * ticket + 2;
+    uint64_t seq;
+    uint32_t size;
+
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if(seq < published)
+    {
+        return -EAGAIN;
+    }
+    if(seq > published)
+    {
+        return -ENOENT;
+    }
+
+    size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+    memcpy(buf, slot->data, size < len ? size : len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); //Finish the copy before checking it wasn't overwritten
+    if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+    {
+        return -ENOENT;
+    }
+    return size <= len ? (ssize_t)size : -EMSGSIZE;
+}
+
+/**
+ * Sets @param cursor to a snapshot of every entry @param ring currently holds, oldest first
+ */
+void aesd_lockfree_ring_cursor_init(struct aesd_lockfree_ring *ring, struct aesd_lockfree_cursor *cursor)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    cursor->next = head > ring->capacity ? head - ring->capacity : 0;
+    cursor->end = head;
+    cursor->lost = 0;
+}
+
+/**
+ * Extends @param cursor to the entries appended since its last snapshot, so that
+ * aesd_lockfree_ring_next() continues where it stopped but still ends even while producers keep
+ * appending.  If cursor->next is older than the oldest entry still held, it is moved forward and
+ * the entries skipped are added to cursor->lost.
+ */
+void aesd_lockfree_ring_snapshot(struct aesd_lockfree_ring *ring, struct aesd_lockfree_cursor *cursor)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t oldest = head > ring->capacity ? head - ring->capacity : 0;
+
+    if(cursor->next < oldest)
+    {
+        cursor->lost += oldest - cursor->next;
+        cursor->next = oldest;
+    }
+    cursor->end = head;
+}
+
+/**
+ * Copies the next entry of the snapshot taken by aesd_lockfree_ring_snapshot() to @param buf
+ * and advances @param cursor past it.  Entries overwritten before they could be copied are
+ * skipped and counted in cursor->lost.
+ * @return the entry size, -ENODATA at the end of the snapshot, -EAGAIN if the next entry is
+ * still being written, or -EMSGSIZE if @param len is smaller than the entry
+ */
+ssize_t aesd_lockfree_ring_next(struct aesd_lockfree_ring *ring, struct aesd_lockfree_cursor *cursor,
+            void *buf, size_t len)
+{
+    ssize_t ret;
+
+    while(cursor->next < cursor->end)
+    {
+        ret = aesd_lockfree_ring_read(ring, cursor->next, buf, len);
+        if(ret == -ENOENT)
+        {
+            cursor->lost++;
+            cursor->next++;
+            continue;
+        }
+        if(ret >= 0)
+        {
+            cursor->next++;
+        }
+        return ret;
+    }
+    return -ENODATA;
+}
@@ -0,0 +1,92 @@
+/*
+ * aesd-lockfree-ring.h
+ *
+ *  @brief Lock-free multi-producer, multi-reader history ring for userspace
+ *
+ * Holds the last capacity entries like struct aesd_circular_buffer, but any
+ * number of threads may append and read concurrently without a lock.  Every
+ * entry gets a sequence number, its ticket, from a shared counter.  Entry
+ * data is copied into a fixed size slot, so readers never follow a pointer
+ * that a producer could free.
+ *
+ * Each slot carries a sequence value: 2 * ticket + 1 while the producer of
+ * ticket is writing it and 2 * ticket + 2 once the entry is published.  A
+ * reader copies an entry and then checks the value didn't change, so an
+ * entry overwritten mid-copy is detected and reported as lost instead of
+ * returned torn.
+ *
+ * Not for use in the kernel, the driver has its own seqcount protected ring.
+ */
+
+#ifndef AESD_LOCKFREE_RING_H
+#define AESD_LOCKFREE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct aesd_lockfree_slot
+{
+    /**
+     * 2 * ticket + 1 while being written, 2 * ticket + 2 once published, 0 if never used
+     */
+    uint64_t seq;
+    /**
+     * Number of bytes in data
+     */
+    uint32_t size;
+    char data[];
+};
+
+struct aesd_lockfree_ring
+{
+    /**
+     * Ticket of the next entry to append, advanced by every producer
+     */
+    uint64_t head;
+    /**
+     * Number of slots, a power of two
+     */
+    uint32_t capacity;
+    /**
+     * Largest entry a slot can hold
+     */
+    uint32_t slot_size;
+    /**
+     * Bytes between consecutive slots, a multiple of the cache line size
+     */
+    size_t stride;
+    char *slots;
+};
+
+/**
+ * A reader's position.  next is the ticket of the next entry to return, end
+ * bounds a snapshot, see aesd_lockfree_ring_cursor_init() and
+ * aesd_lockfree_ring_snapshot().
+ */
+struct aesd_lockfree_cursor
+{
+    uint64_t next;
+    uint64_t end;
+    /**
+     * Entries skipped because they were overwritten before they could be read
+     */
+    uint64_t lost;
+};
+
+extern int aesd_lockfree_ring_init(struct aesd_lockfree_ring *ring, uint32_t capacity, uint32_t slot_size);
+
+extern void aesd_lockfree_ring_free(struct aesd_lockfree_ring *ring);
+
+extern int64_t aesd_lockfree_ring_push(struct aesd_lockfree_ring *ring, const void *data, size_t size);
+
+extern ssize_t aesd_lockfree_ring_read(struct aesd_lockfree_ring *ring, uint64_t ticket, void *buf, size_t len);
+
+extern void aesd_lockfree_ring_cursor_init(struct aesd_lockfree_ring *ring, struct aesd_lockfree_cursor *cursor);
+
+extern void aesd_lockfree_ring_snapshot(struct aesd_lockfree_ring *ring, struct aesd_lockfree_cursor *cursor);
+
+extern ssize_t aesd_lockfree_ring_next(struct aesd_lockfree_ring *ring, struct aesd_lockfree_cursor *cursor,
+            void *buf, size_t len);
+
+#endif /* AESD_LOCKFREE_RING_H */
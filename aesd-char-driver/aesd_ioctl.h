@@ -33,14 +33,70 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One entry of the table returned by AESDCHAR_IOCLAYOUT
+ */
+struct aesd_layout_entry {
+    /**
+     * Absolute offset of the entry's first byte, subtract base_offset for the file position
+     */
+    uint64_t offset;
+    /**
+     * Number of bytes in the entry
+     */
+    uint64_t size;
+};
+
+/**
+ * Describes the whole ring in one AESDCHAR_IOCLAYOUT call
+ */
+struct aesd_layout {
+    /**
+     * In: user address of an array of max_entries struct aesd_layout_entry, oldest entry first
+     */
+    uint64_t entries;
+    /**
+     * In: number of elements in entries, may be 0 to only query count
+     */
+    uint32_t max_entries;
+    /**
+     * Out: number of entries stored.  Only the oldest max_entries are written if it is larger
+     */
+    uint32_t count;
+    /**
+     * Out: absolute offset of the oldest entry, i.e. the number of bytes evicted so far
+     */
+    uint64_t base_offset;
+    /**
+     * Out: number of bytes stored across all entries, the size seen by llseek
+     */
+    uint64_t total_size;
+    /**
+     * Out: advanced whenever entries are added or evicted, equal values mean an unchanged layout
+     */
+    uint64_t generation;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Pass a pointer to a non-zero uint32_t to make reads on this open file tail the device:
+ * reads at the end of the data block until a new command is committed (or fail with
+ * EAGAIN if O_NONBLOCK is set) instead of returning 0.  While tailing, the read position
+ * is kept as an absolute offset so evictions don't move it.  Pass zero to restore the
+ * default end-of-file behaviour.
+ */
+#define AESDCHAR_IOCTAIL _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Fills a struct aesd_layout with a consistent snapshot of the ring's entry table
+ */
+#define AESDCHAR_IOCLAYOUT _IOWR(AESD_IOC_MAGIC, 3, struct aesd_layout)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
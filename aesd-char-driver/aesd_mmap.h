@@ -0,0 +1,105 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of the read-only mapping exposed by mmap() on aesd char devices
+ *
+ * The mapping starts with a struct aesd_mmap_header, padded to header_size
+ * (a multiple of the page size), followed by data_size bytes of data log.
+ * Every committed write command is appended to the log, so the bytes of an
+ * entry live at data[(data_pos + i) % data_size] for as long as the log has
+ * not wrapped over them, see aesd_mmap_entry_available().
+ *
+ * When the driver is loaded with inline_data=1 the data log is where commands
+ * are stored rather than a copy of them.  Entries then never wrap: an entry is
+ * contiguous at data[data_pos % data_size], and the log may skip over unused
+ * bytes at its end.
+ *
+ * The header is updated with a sequence protocol: generation is odd while the
+ * driver is changing it.  A consistent read looks like
+ *
+ *     do {
+ *         gen = __atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE);
+ *         if (gen & 1) continue;
+ *         ... copy what is needed from the header and data ...
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     } while (__atomic_load_n(&hdr->generation, __ATOMIC_RELAXED) != gen);
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#endif
+
+#define AESD_MMAP_MAGIC 0x41455344 /* "AESD" */
+
+/**
+ * Describes one ring entry in the mapping
+ */
+struct aesd_mmap_entry {
+    /**
+     * Absolute device offset of the entry's first byte, subtract base_offset for the file position
+     */
+    uint64_t offset;
+    /**
+     * Position of the entry's first byte in the data log, before wrapping
+     */
+    uint64_t data_pos;
+    /**
+     * Number of bytes in the entry
+     */
+    uint64_t size;
+};
+
+struct aesd_mmap_header {
+    uint32_t magic;
+    /**
+     * Offset of the data log from the start of the mapping
+     */
+    uint32_t header_size;
+    /**
+     * Number of bytes in the data log
+     */
+    uint64_t data_size;
+    /**
+     * Odd while the driver is updating the mapping, advanced on every committed command
+     */
+    uint64_t generation;
+    /**
+     * Data log position one past the last byte written
+     */
+    uint64_t data_head;
+    /**
+     * Absolute device offset of the oldest entry
+     */
+    uint64_t base_offset;
+    /**
+     * Number of slots in entries, equal to the ring capacity
+     */
+    uint32_t capacity;
+    /**
+     * Slot in entries holding the oldest entry
+     */
+    uint32_t first;
+    /**
+     * Number of entries stored, starting at first and wrapping at capacity
+     */
+    uint32_t count;
+    uint32_t reserved;
+    struct aesd_mmap_entry entries[];
+};
+
+/**
+ * @return true if the bytes of @param entry are still present in the data log of @param hdr
+ */
+static inline bool aesd_mmap_entry_available(const struct aesd_mmap_header *hdr,
+                                             const struct aesd_mmap_entry *entry)
+{
+    return hdr->data_head - entry->data_pos <= hdr->data_size;
+}
+
+#endif /* AESD_MMAP_H */
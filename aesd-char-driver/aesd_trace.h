@@ -0,0 +1,145 @@
+/*
+ * aesd_trace.h
+ *
+ *  @brief Tracepoints for the aesdchar hot paths
+ *
+ * Enable with e.g.
+ *     echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ *     cat /sys/kernel/tracing/trace_pipe
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESD_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "aesdchar.h"
+
+TRACE_EVENT(aesd_open,
+    TP_PROTO(struct aesd_dev *dev, struct file *filp),
+    TP_ARGS(dev, filp),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, flags)
+    ),
+    TP_fast_assign(
+        __entry->minor = MINOR(dev->cdev.dev);
+        __entry->flags = filp->f_flags;
+    ),
+    TP_printk("minor=%u flags=0x%x", __entry->minor, __entry->flags)
+);
+
+TRACE_EVENT(aesd_read,
+    TP_PROTO(struct aesd_dev *dev, uint64_t pos, size_t count, ssize_t ret),
+    TP_ARGS(dev, pos, count, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(uint64_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = MINOR(dev->cdev.dev);
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u pos=%llu count=%zu ret=%zd", __entry->minor,
+              (unsigned long long)__entry->pos, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(aesd_write,
+    TP_PROTO(struct aesd_dev *dev, size_t count, ssize_t ret),
+    TP_ARGS(dev, count, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = MINOR(dev->cdev.dev);
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u count=%zu ret=%zd", __entry->minor, __entry->count, __entry->ret)
+);
+
+/*
+ * Shared by entries entering and leaving the ring, offset is the absolute
+ * offset of the entry's first byte
+ */
+DECLARE_EVENT_CLASS(aesd_entry_class,
+    TP_PROTO(struct aesd_dev *dev, uint64_t offset, size_t size),
+    TP_ARGS(dev, offset, size),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(uint64_t, offset)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->minor = MINOR(dev->cdev.dev);
+        __entry->offset = offset;
+        __entry->size = size;
+    ),
+    TP_printk("minor=%u offset=%llu size=%zu", __entry->minor,
+              (unsigned long long)__entry->offset, __entry->size)
+);
+
+DEFINE_EVENT(aesd_entry_class, aesd_commit,
+    TP_PROTO(struct aesd_dev *dev, uint64_t offset, size_t size),
+    TP_ARGS(dev, offset, size)
+);
+
+DEFINE_EVENT(aesd_entry_class, aesd_evict,
+    TP_PROTO(struct aesd_dev *dev, uint64_t offset, size_t size),
+    TP_ARGS(dev, offset, size)
+);
+
+TRACE_EVENT(aesd_llseek,
+    TP_PROTO(struct aesd_dev *dev, loff_t offset, int whence, loff_t ret),
+    TP_ARGS(dev, offset, whence, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = MINOR(dev->cdev.dev);
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u offset=%lld whence=%d ret=%lld", __entry->minor,
+              __entry->offset, __entry->whence, __entry->ret)
+);
+
+TRACE_EVENT(aesd_ioc_seekto,
+    TP_PROTO(struct aesd_dev *dev, uint32_t write_cmd, uint32_t write_cmd_offset, loff_t pos),
+    TP_ARGS(dev, write_cmd, write_cmd_offset, pos),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(uint32_t, write_cmd)
+        __field(uint32_t, write_cmd_offset)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->minor = MINOR(dev->cdev.dev);
+        __entry->write_cmd = write_cmd;
+        __entry->write_cmd_offset = write_cmd_offset;
+        __entry->pos = pos;
+    ),
+    TP_printk("minor=%u write_cmd=%u write_cmd_offset=%u pos=%lld", __entry->minor,
+              __entry->write_cmd, __entry->write_cmd_offset, __entry->pos)
+);
+
+#endif /* _AESD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesd_trace
+#include <trace/define_trace.h>
@@ -9,8 +9,9 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd_mmap.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, or build with make DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,11 +26,62 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/*
+ * Storage for a committed write command.  Entry buffptr values point at data,
+ * the rcu head lets an evicted entry be freed once no lockless reader can
+ * still be copying from it.
+ */
+struct aesd_entry_data {
+    struct rcu_head rcu;
+    char data[];
+};
+
+#define AESD_HIST_BUCKETS 32
+
+/*
+ * Counters exposed in debugfs.  All but bytes_read are updated with the
+ * device lock held.  Histogram bucket n counts durations of [2^n, 2^(n+1)) ns.
+ */
+struct aesd_stats {
+    uint64_t evictions;                /* Entries dropped from the ring */
+    uint64_t bytes_written;            /* Bytes accepted by write */
+    atomic64_t bytes_read;             /* Bytes returned by read, readers don't take the lock */
+    uint64_t partial_bytes;            /* Bytes of unterminated commands held for open files and the device */
+    uint64_t lock_acquired;
+    uint64_t lock_contended;           /* Acquisitions that had to wait */
+    uint64_t lock_start_ns;            /* When the current holder took the lock */
+    uint64_t lock_wait_hist[AESD_HIST_BUCKETS];
+    uint64_t lock_hold_hist[AESD_HIST_BUCKETS];
+};
+
 struct aesd_dev {
     struct aesd_circular_buffer circular_buffer;
-    struct mutex lock;
+    struct mutex lock;                 /* Serializes writers */
+    seqcount_mutex_t seq;              /* Lets readers snapshot the ring without the lock */
+    uint64_t generation;               /* Advanced in every seq write section, see AESDCHAR_IOCLAYOUT */
+    struct srcu_struct srcu;           /* Readers hold this while copying entry data */
     struct cdev cdev;                  /* Char device structure */
-    struct aesd_buffer_entry partial_entry;    
+    struct aesd_buffer_entry partial_entry;    /* Fragment left by a file closed mid-command */
+    size_t partial_alloc;              /* Bytes allocated for partial_entry data */
+    struct aesd_mmap_header *mmap_hdr; /* vmalloc_user area exposed by mmap, NULL if disabled */
+    char *mmap_data;                   /* Data log following the header in the same area */
+    wait_queue_head_t wait_queue;      /* Woken when a command is committed */
+    struct fasync_struct *async_queue; /* SIGIO subscribers */
+    struct aesd_stats stats;
+    struct dentry *debugfs;            /* Per-device debugfs directory */
+};
+
+/*
+ * Per-open state.  Each file accumulates its own incomplete command so that
+ * concurrent writers' fragments don't interleave.
+ */
+struct aesd_file {
+    struct aesd_dev *dev;
+    struct aesd_buffer_entry partial_entry;    /* Command received so far, not yet committed */
+    size_t partial_alloc;              /* Bytes allocated for partial_entry data */
+    size_t partial_scanned;            /* Leading bytes of partial_entry known to hold no newline */
+    bool tail;                         /* Reads at the end block for new data, see AESDCHAR_IOCTAIL */
+    uint64_t tail_pos;                 /* Absolute read offset used while tail is set */
 };
 
 
@@ -25,185 +25,917 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/uio.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
 #include "aesd_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "aesd_trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+#define AESD_MAX_RING_CAPACITY (1U << 20)
+
+static unsigned int aesd_ring_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param_named(ring_capacity, aesd_ring_capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_capacity, "Number of write commands kept in the history ring");
+
+static unsigned long aesd_max_bytes;
+module_param_named(max_bytes, aesd_max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_bytes, "Bytes of command data kept in the history ring, 0 for no limit");
+
+#define AESD_MAX_DEVICES 256
+
+static unsigned int aesd_nr_devs = 1;
+module_param_named(nr_devs, aesd_nr_devs, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devs, "Number of aesdchar devices, each with its own ring and lock");
+
+static unsigned int aesd_mmap_size;
+module_param_named(mmap_size, aesd_mmap_size, uint, S_IRUGO);
+MODULE_PARM_DESC(mmap_size, "Bytes of history exposed through mmap, 0 disables mmap");
+
+static bool aesd_inline_data;
+module_param_named(inline_data, aesd_inline_data, bool, S_IRUGO);
+MODULE_PARM_DESC(inline_data, "Store commands in the mmap data log instead of one allocation each");
+
 MODULE_AUTHOR("Tim Bailey");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+#define AESD_PARTIAL_MIN_ALLOC 64
 
-int aesd_open(struct inode *inode, struct file *filp)
+struct aesd_dev *aesd_devices; // aesd_nr_devs devices, one per minor
+static struct dentry *aesd_debugfs_root;
+
+static inline unsigned int aesd_hist_bucket(uint64_t ns)
 {
-    PDEBUG("open");
-    struct aesd_dev *dev;
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
-    return 0;
+    return min_t(unsigned int, ns ? ilog2(ns) : 0, AESD_HIST_BUCKETS - 1);
 }
 
-int aesd_release(struct inode *inode, struct file *filp)
+/*
+ * Takes dev->lock, counting contention and wait time in dev->stats.  Returns
+ * -EINTR if @interruptible and a signal arrived while waiting.
+ */
+static int aesd_lock(struct aesd_dev *dev, bool interruptible)
 {
-    PDEBUG("release");
+    uint64_t start;
+
+    if (!mutex_trylock(&dev->lock)) {
+        start = ktime_get_ns();
+        if (!interruptible) {
+            mutex_lock(&dev->lock);
+        } else if (mutex_lock_interruptible(&dev->lock)) {
+            return -EINTR;
+        }
+        dev->stats.lock_contended++;
+        dev->stats.lock_wait_hist[aesd_hist_bucket(ktime_get_ns() - start)]++;
+    }
+    dev->stats.lock_acquired++;
+    dev->stats.lock_start_ns = ktime_get_ns();
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static void aesd_unlock(struct aesd_dev *dev)
+{
+    dev->stats.lock_hold_hist[aesd_hist_bucket(ktime_get_ns() - dev->stats.lock_start_ns)]++;
+    mutex_unlock(&dev->lock);
+}
+
+static inline struct aesd_entry_data *aesd_entry_data(const char *buffptr)
+{
+    return container_of((char *)buffptr, struct aesd_entry_data, data[0]);
+}
+
+static void aesd_entry_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, struct aesd_entry_data, rcu));
+}
+
+/*
+ * Frees an entry that has been removed from the ring once every reader that
+ * could have seen it has left its srcu read section.
+ */
+static void aesd_entry_free_deferred(struct aesd_dev *dev, const char *buffptr)
+{
+    call_srcu(&dev->srcu, &aesd_entry_data(buffptr)->rcu, aesd_entry_free_rcu);
+}
+
+/*
+ * Copies the ring entry holding position *@pos into @snapshot without taking
+ * dev->lock, retrying if a writer changed the ring meanwhile.  Must be called
+ * inside an srcu read section so snapshot->buffptr stays valid.
+ * *@pos is a file position relative to the oldest entry or, with @absolute,
+ * an offset counted from the first byte ever written.  An absolute position
+ * that has already been evicted is moved forward to the oldest byte held.
+ * *@entry_start is set to the absolute offset of the entry's first byte.
+ * Returns false if there is no data at *@pos.
+ */
+static bool aesd_snapshot_entry(struct aesd_dev *dev, uint64_t *pos, bool absolute,
+                                struct aesd_buffer_entry *snapshot, size_t *entry_offset_byte,
+                                uint64_t *entry_start)
 {
-    struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
     struct aesd_circular_buffer *circular_buffer = &dev->circular_buffer;
-    struct aesd_buffer_entry *entry = NULL;
-    size_t bytes_to_read;
-    size_t bytes_read = 0;
-    size_t entry_offset_byte;
-    
-    if (buf == NULL) {
-        return -EFAULT; //Check for invalid user buffer
+    struct aesd_buffer_entry *entry;
+    uint64_t base;
+    uint64_t start;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        base = absolute ? circular_buffer->base_offset : 0;
+        start = max(*pos, base);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(circular_buffer, start - base,
+                                                                entry_offset_byte);
+        if (entry != NULL) {
+            *snapshot = *entry;
+            *entry_start = circular_buffer->entry_offset[entry - circular_buffer->entry];
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    *pos = start;
+    return entry != NULL;
+}
+
+/*
+ * Returns the absolute offset one past the last byte held by the ring.
+ */
+static uint64_t aesd_end_offset(struct aesd_dev *dev)
+{
+    uint64_t end;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        end = dev->circular_buffer.base_offset + dev->circular_buffer.total_size;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    return end;
+}
+
+/*
+ * Returns true if the entry starting at absolute offset @entry_start has been
+ * evicted.  With inline_data, an evicted entry's bytes may already have been
+ * overwritten, so data copied from it must be discarded.
+ */
+static bool aesd_entry_evicted(struct aesd_dev *dev, uint64_t entry_start)
+{
+    uint64_t base;
+    unsigned int seq;
+
+    smp_rmb(); //Order the data copy before the check, pairs with aesd_inline_reserve()
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        base = dev->circular_buffer.base_offset;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    return entry_start < base;
+}
+
+/*
+ * Returns true if @file has stored data beyond its read position.
+ */
+static bool aesd_file_has_data(struct aesd_dev *dev, struct aesd_file *file, loff_t f_pos)
+{
+    unsigned int seq;
+    bool has_data;
+
+    if (READ_ONCE(file->tail)) {
+        return aesd_end_offset(dev) > READ_ONCE(file->tail_pos);
     }
 
-    mutex_lock(&dev->lock); //Lock for synchronized access
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        has_data = aesd_circular_buffer_total_size(&dev->circular_buffer) > f_pos;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    return has_data;
+}
+
+/*
+ * Makes room for @extra more bytes in @partial.  The allocation grows
+ * geometrically so a command arriving in many small writes is copied
+ * O(log n) times instead of once per write.
+ */
+static int aesd_partial_reserve(struct aesd_buffer_entry *partial, size_t *alloc, size_t extra)
+{
+    struct aesd_entry_data *data = NULL;
+    size_t needed = partial->size + extra;
+    size_t new_alloc;
 
-    //Find entry in circular buffer at file position
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(circular_buffer, *f_pos, &entry_offset_byte);
-    
-    if(entry == NULL) {
-        mutex_unlock(&dev->lock); //Unlock and return if no entry found
+    if (needed <= *alloc) {
         return 0;
     }
 
-    bytes_to_read = entry->size - entry_offset_byte; //Calculate bytes to read
-
-    if (bytes_to_read > count) {
-        bytes_to_read = count; //Limit to requested count
+    new_alloc = max3(*alloc * 2, needed, (size_t)AESD_PARTIAL_MIN_ALLOC);
+    if (partial->buffptr != NULL) {
+        data = aesd_entry_data(partial->buffptr);
+    }
+    data = krealloc(data, sizeof(*data) + new_alloc, GFP_KERNEL);
+    if (!data) {
+        return -ENOMEM;
     }
 
-    //Copy data to user buffer
-    if (copy_to_user(buf, entry->buffptr + entry_offset_byte, bytes_to_read)) {
-        mutex_unlock(&dev->lock); //Unlock and return error if copy fails
-        return -EFAULT;
+    partial->buffptr = data->data;
+    *alloc = new_alloc;
+    return 0;
+}
+
+static void aesd_partial_free(struct aesd_buffer_entry *partial, size_t *alloc)
+{
+    if (partial->buffptr != NULL) {
+        kfree(aesd_entry_data(partial->buffptr));
     }
+    partial->buffptr = NULL;
+    partial->size = 0;
+    *alloc = 0;
+}
 
-    *f_pos += bytes_to_read; //Update file position
-    bytes_read = bytes_to_read; //Record bytes read
+/*
+ * Drops the oldest ring entry, releasing its storage once readers are done
+ * with it.  Caller must hold dev->lock and be inside a dev->seq write section.
+ */
+static void aesd_evict_oldest(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry evicted;
+    uint64_t offset = dev->circular_buffer.base_offset;
 
-    mutex_unlock(&dev->lock); //Unlock after operation
-    return bytes_read; //Return bytes read
+    aesd_circular_buffer_remove_entry(&dev->circular_buffer, &evicted);
+    trace_aesd_evict(dev, offset, evicted.size);
+    dev->stats.evictions++;
+    if (!aesd_inline_data) {
+        aesd_entry_free_deferred(dev, evicted.buffptr); //Free old buffer once readers are done with it
+    }
 }
 
+/*
+ * Returns the data log position of @buffptr, which points into the data log.
+ * Every entry lies within the data_size bytes before data_head.
+ */
+static uint64_t aesd_inline_pos(struct aesd_dev *dev, const char *buffptr)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_hdr;
+    uint64_t offset = buffptr - dev->mmap_data;
+    uint64_t window;
 
+    if (hdr->data_head <= hdr->data_size) {
+        return offset; //The log has not wrapped yet
+    }
+    window = hdr->data_head - hdr->data_size;
+    return window + (offset + hdr->data_size - window % hdr->data_size) % hdr->data_size;
+}
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                   loff_t *f_pos)
+/*
+ * Makes room for @size contiguous bytes at the head of the data log and
+ * returns where they start.  Entries never wrap, a reservation that would
+ * skips to the start of the log.  Entries whose bytes are about to be
+ * overwritten are evicted first, so lockless readers that raced with the
+ * overwrite notice it in aesd_entry_evicted().  Caller must hold dev->lock,
+ * @size must not exceed data_size.
+ */
+static char *aesd_inline_reserve(struct aesd_dev *dev, size_t size)
 {
-    struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
     struct aesd_circular_buffer *circular_buffer = &dev->circular_buffer;
-    struct aesd_buffer_entry new_entry;
-    ssize_t bytes_written = 0;
-    size_t bytes_missing = 0;
-    uint8_t in_pos = 0;
-    char *tmp_buf = NULL;
+    struct aesd_mmap_header *hdr = dev->mmap_hdr;
+    uint64_t pos = hdr->data_head;
+    size_t offset = pos % hdr->data_size;
 
-    if (buf == NULL) {
-        return -EFAULT; //Check for invalid user buffer
+    if (offset + size > hdr->data_size) {
+        pos += hdr->data_size - offset;
+        offset = 0;
     }
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS; //Return if lock interrupted
+    write_seqcount_begin(&dev->seq);
+    dev->generation++;
+    while (aesd_circular_buffer_count(circular_buffer) > 0 &&
+           hdr->entries[circular_buffer->out_offs].data_pos + hdr->data_size < pos + size) {
+        aesd_evict_oldest(dev);
     }
+    write_seqcount_end(&dev->seq);
+
+    //Advance data_head before the bytes change so mmap readers see the overwritten entries as unavailable
+    WRITE_ONCE(hdr->generation, hdr->generation + 1);
+    smp_wmb();
+    hdr->data_head = pos + size;
+    hdr->base_offset = circular_buffer->base_offset;
+    hdr->first = circular_buffer->out_offs;
+    hdr->count = aesd_circular_buffer_count(circular_buffer);
+    smp_wmb();
+    WRITE_ONCE(hdr->generation, hdr->generation + 1);
+
+    return dev->mmap_data + offset;
+}
+
+/*
+ * Appends the entry just added at ring slot @slot to the mmap data log and
+ * republishes the header.  With inline_data the entry already lives in the
+ * log and only its descriptor is published.  Caller must hold dev->lock.
+ */
+static void aesd_mmap_publish(struct aesd_dev *dev, uint32_t slot)
+{
+    struct aesd_circular_buffer *circular_buffer = &dev->circular_buffer;
+    struct aesd_mmap_header *hdr = dev->mmap_hdr;
+    struct aesd_buffer_entry *entry = &circular_buffer->entry[slot];
+    struct aesd_mmap_entry *desc = &hdr->entries[slot];
+    uint64_t head = hdr->data_head;
+    size_t skip = 0;
+    size_t pos;
+    size_t chunk;
+
+    WRITE_ONCE(hdr->generation, hdr->generation + 1); //Odd, readers retry
+    smp_wmb();
 
-    //Append to existing buffer if exists
-    if (dev->partial_entry.buffptr != NULL) {
-        tmp_buf = krealloc(dev->partial_entry.buffptr, dev->partial_entry.size + count, GFP_KERNEL);
-        if (!tmp_buf) {
-            bytes_written = -ENOMEM; //Return error if allocation fails
-            mutex_unlock(&dev->lock);
-            return bytes_written;
+    if (aesd_inline_data) {
+        head = aesd_inline_pos(dev, entry->buffptr);
+    } else {
+        //An entry larger than the log only advances the head, it can never be available
+        if (entry->size > hdr->data_size) {
+            skip = entry->size;
         }
-        dev->partial_entry.buffptr = tmp_buf; //Update partial entry buffer
+        while (skip < entry->size) {
+            pos = (head + skip) % hdr->data_size;
+            chunk = min_t(size_t, entry->size - skip, hdr->data_size - pos);
+            memcpy(dev->mmap_data + pos, entry->buffptr + skip, chunk);
+            skip += chunk;
+        }
+        hdr->data_head = head + entry->size;
+    }
+
+    desc->offset = circular_buffer->entry_offset[slot];
+    desc->data_pos = head;
+    desc->size = entry->size;
+    hdr->base_offset = circular_buffer->base_offset;
+    hdr->first = circular_buffer->out_offs;
+    hdr->count = aesd_circular_buffer_count(circular_buffer);
+
+    smp_wmb();
+    WRITE_ONCE(hdr->generation, hdr->generation + 1);
+}
+
+/*
+ * Adds the complete command @command to the ring, evicting the oldest entries
+ * while the ring is full or over its byte limit.  The ring takes ownership of command->buffptr, which
+ * must point at the data of a struct aesd_entry_data, or into the data log
+ * reserved by aesd_inline_reserve() with inline_data.  Caller must hold dev->lock.
+ */
+static void aesd_commit_entry(struct aesd_dev *dev, const struct aesd_buffer_entry *command)
+{
+    struct aesd_circular_buffer *circular_buffer = &dev->circular_buffer;
+    uint32_t slot;
+
+    write_seqcount_begin(&dev->seq); //Readers retry if they overlap the update
+    dev->generation++;
+
+    //Handle circular buffer full condition, the oldest entries are dropped
+    while (aesd_circular_buffer_must_evict(circular_buffer, command->size)) {
+        aesd_evict_oldest(dev);
+    }
+
+    slot = circular_buffer->in_offs;
+    aesd_circular_buffer_add_entry(circular_buffer, command); //Add to circular buffer
+    write_seqcount_end(&dev->seq);
+    trace_aesd_commit(dev, circular_buffer->entry_offset[slot], command->size);
 
-        //Copy user data to buffer and update size
-        bytes_missing = copy_from_user(&dev->partial_entry.buffptr[dev->partial_entry.size], buf, count);
-        bytes_written = count - bytes_missing;
-        dev->partial_entry.size += bytes_written;
+    if (dev->mmap_hdr != NULL) {
+        aesd_mmap_publish(dev, slot);
+    }
+
+    //Wake up tailing readers
+    wake_up_interruptible(&dev->wait_queue);
+    kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+/*
+ * Commits a copy of the @size byte command at @data.  Returns -ENOMEM if no
+ * storage could be allocated.  Caller must hold dev->lock.
+ */
+static int aesd_commit_copy(struct aesd_dev *dev, const char *data, size_t size)
+{
+    struct aesd_buffer_entry command;
+    struct aesd_entry_data *entry_data;
+    char *buf;
+
+    if (aesd_inline_data) {
+        buf = aesd_inline_reserve(dev, size);
     } else {
-        //Allocate new buffer for partial entry
-        tmp_buf = kzalloc(count, GFP_KERNEL);
-        if (!tmp_buf) {
-            bytes_written = -ENOMEM; //Return error if allocation fails
-            mutex_unlock(&dev->lock);
-            return bytes_written;
+        entry_data = kmalloc(sizeof(*entry_data) + size, GFP_KERNEL);
+        if (!entry_data) {
+            return -ENOMEM;
+        }
+        buf = entry_data->data;
+    }
+
+    memcpy(buf, data, size);
+    command.buffptr = buf;
+    command.size = size;
+    aesd_commit_entry(dev, &command);
+    return 0;
+}
+
+/*
+ * Commits every newline-terminated command in @file's partial entry.  Bytes
+ * before file->partial_scanned are known to hold no newline.  The common case
+ * of the buffer holding exactly one command hands the buffer to the ring
+ * without a copy; otherwise each command is copied out and the unterminated
+ * remainder moved to the front.  Commands that can't be stored are left at the
+ * front, and the next write scans them again.  Caller must hold dev->lock.
+ */
+static void aesd_commit_commands(struct aesd_dev *dev, struct aesd_file *file)
+{
+    struct aesd_buffer_entry *partial = &file->partial_entry;
+    size_t command_size;
+    char *buf = (char *)partial->buffptr;
+    const char *nl;
+    size_t scan_from = file->partial_scanned;
+    size_t start = 0;
+    size_t from;
+
+    file->partial_scanned = 0;
+    while (true) {
+        from = max(start, scan_from);
+        nl = memchr(buf + from, '\n', partial->size - from);
+        if (nl == NULL) {
+            file->partial_scanned = partial->size - start; //Rest of the buffer is an unterminated command
+            break;
+        }
+        command_size = nl - buf + 1 - start;
+
+        if (!aesd_inline_data && start == 0 && command_size == partial->size &&
+            file->partial_alloc - command_size <= command_size / 8) {
+            //The buffer holds exactly one command and little slack, the ring owns it now.
+            //A buffer grown well past its command is copied from instead and kept for the next
+            //command, so history doesn't hold up to twice the bytes it stores.
+            aesd_commit_entry(dev, partial);
+            partial->buffptr = NULL;
+            partial->size = 0;
+            file->partial_alloc = 0;
+            return;
+        }
+
+        if (aesd_commit_copy(dev, buf + start, command_size)) {
+            break; //Keep the rest, the next write scans it again from the start
+        }
+        start += command_size;
+    }
+
+    memmove(buf, buf + start, partial->size - start);
+    partial->size -= start;
+}
+
+static int aesd_fasync(int fd, struct file *filp, int on)
+{
+    struct aesd_file *file = filp->private_data;
+
+    return fasync_helper(fd, filp, on, &file->dev->async_queue);
+}
+
+int aesd_open(struct inode *inode, struct file *filp)
+{
+    PDEBUG("open");
+    struct aesd_file *file;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file) {
+        return -ENOMEM;
+    }
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    filp->private_data = file;
+    trace_aesd_open(file->dev, filp);
+    return 0;
+}
+
+int aesd_release(struct inode *inode, struct file *filp)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    PDEBUG("release");
+    aesd_fasync(-1, filp, 0);
+
+    //Keep an unterminated command so the next writer to open the device can complete it
+    if (file->partial_entry.size > 0) {
+        aesd_lock(dev, false);
+        if (dev->partial_entry.buffptr == NULL) {
+            dev->partial_entry = file->partial_entry;
+            dev->partial_alloc = file->partial_alloc;
+            file->partial_entry.buffptr = NULL;
+        } else if ((!aesd_inline_data || dev->partial_entry.size + file->partial_entry.size <=
+                                         dev->mmap_hdr->data_size) &&
+                   !aesd_partial_reserve(&dev->partial_entry, &dev->partial_alloc,
+                                         file->partial_entry.size)) {
+            memcpy((char *)dev->partial_entry.buffptr + dev->partial_entry.size,
+                   file->partial_entry.buffptr, file->partial_entry.size);
+            dev->partial_entry.size += file->partial_entry.size;
+        } else {
+            dev->stats.partial_bytes -= file->partial_entry.size; //Dropped
+        }
+        aesd_unlock(dev);
+    }
+    aesd_partial_free(&file->partial_entry, &file->partial_alloc);
+
+    kfree(file);
+    return 0;
+}
+
+/*
+ * Copies stored data starting at *@pos to @to without blocking, see
+ * aesd_snapshot_entry() for the meaning of @pos and @absolute.  The bytes
+ * copied are contiguous in the stream: entries after the first are looked up
+ * by absolute offset, and the copy ends early if the next byte was evicted
+ * meanwhile rather than skipping to whatever now sits at *@pos.
+ * Returns the number of bytes copied, or -EFAULT if none could be.
+ */
+static ssize_t aesd_copy_entries(struct aesd_dev *dev, struct iov_iter *to,
+                                 uint64_t *pos, bool absolute)
+{
+    struct aesd_buffer_entry entry;
+    size_t bytes_to_read;
+    size_t bytes_copied;
+    size_t bytes_read = 0;
+    size_t entry_offset_byte;
+    uint64_t entry_start;
+    uint64_t next = 0; //Absolute offset of the next byte to copy once the first entry is copied
+    uint64_t lookup;
+    int idx;
+
+    idx = srcu_read_lock(&dev->srcu); //Keep entries we copy from alive, writers don't wait for us
+
+    //Copy across consecutive entries until the request is satisfied or the data runs out
+    while (iov_iter_count(to) > 0) {
+        //Find entry in circular buffer at file position
+        if (bytes_read == 0) {
+            if (!aesd_snapshot_entry(dev, pos, absolute, &entry, &entry_offset_byte, &entry_start)) {
+                break; //No more data
+            }
+        } else {
+            lookup = next;
+            if (!aesd_snapshot_entry(dev, &lookup, true, &entry, &entry_offset_byte, &entry_start) ||
+                lookup != next) {
+                break; //No more data, or the rest of the stream was evicted since the copy started
+            }
+        }
+
+        bytes_to_read = entry.size - entry_offset_byte; //Calculate bytes to read, copy_to_iter limits it to the request
+
+        //Copy data to the user buffers
+        bytes_copied = copy_to_iter(entry.buffptr + entry_offset_byte, bytes_to_read, to);
+        if (aesd_inline_data && aesd_entry_evicted(dev, entry_start)) {
+            iov_iter_revert(to, bytes_copied); //A writer may have overwritten what we copied
+            if (bytes_read == 0) {
+                continue; //Look *pos up again
+            }
+            break;
+        }
+        bytes_read += bytes_copied; //Record bytes read
+        *pos += bytes_copied;
+        next = entry_start + entry_offset_byte + bytes_copied;
+
+        if (bytes_copied < bytes_to_read && iov_iter_count(to) > 0) {
+            if (bytes_read == 0) {
+                srcu_read_unlock(&dev->srcu, idx); //Return error if nothing was copied
+                return -EFAULT;
+            }
+            break; //Return what was copied so far
+        }
+    }
+
+    srcu_read_unlock(&dev->srcu, idx);
+    return bytes_read;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    bool tail = READ_ONCE(file->tail);
+    size_t count = iov_iter_count(to);
+    uint64_t pos;
+    ssize_t bytes_read;
+
+    //Tailing files follow an absolute offset so evictions don't shift their position
+    pos = tail ? file->tail_pos : iocb->ki_pos;
+
+    while (true) {
+        bytes_read = aesd_copy_entries(dev, to, &pos, tail);
+        if (bytes_read != 0 || iov_iter_count(to) == 0 || !tail) {
+            break;
         }
 
-        //Copy user data to buffer
-        bytes_missing = copy_from_user(tmp_buf, buf, count);
-        bytes_written = count - bytes_missing;
+        //At the end of the data, wait for the next committed command
+        if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+            bytes_read = -EAGAIN;
+            break;
+        }
+        if (wait_event_interruptible(dev->wait_queue, aesd_end_offset(dev) > pos)) {
+            bytes_read = -ERESTARTSYS;
+            break;
+        }
+    }
 
-        dev->partial_entry.buffptr = tmp_buf; //Set partial entry buffer
-        dev->partial_entry.size = bytes_written; //Set partial entry size
+    trace_aesd_read(dev, iocb->ki_pos, count, bytes_read);
+    if (bytes_read < 0) {
+        return bytes_read;
     }
+    atomic64_add(bytes_read, &dev->stats.bytes_read);
+
+    if (tail) {
+        file->tail_pos = pos;
+    }
+    iocb->ki_pos += bytes_read; //Update file position
+    return bytes_read; //Return bytes read
+}
+
+/*
+ * Returns how many bytes of @from, up to @count, come before and including
+ * its last newline, or 0 if it holds none.  @from is read backwards from the
+ * end through copies, so only the unterminated tail is scanned and @from
+ * itself is not advanced.
+ */
+static size_t aesd_iter_terminated(const struct iov_iter *from, size_t count)
+{
+    struct iov_iter tail;
+    char chunk[64];
+    size_t end = count;
+    size_t len;
 
-    //Check for newline in partial entry
-    if (memchr(dev->partial_entry.buffptr, '\n', dev->partial_entry.size)) {
-        //Handle circular buffer full condition
-        if (circular_buffer->full) {
-            in_pos = circular_buffer->in_offs;
-            if (circular_buffer->entry[in_pos].buffptr != NULL) {
-                kfree(circular_buffer->entry[in_pos].buffptr); //Free old buffer
+    while (end > 0) {
+        len = min(end, sizeof(chunk));
+        tail = *from;
+        iov_iter_advance(&tail, end - len);
+        if (copy_from_iter(chunk, len, &tail) != len) {
+            return count; //Fault, the copy into the log reports the short write
+        }
+        end -= len;
+        while (len > 0) {
+            if (chunk[--len] == '\n') {
+                return end + len + 1;
             }
-            circular_buffer->entry[in_pos].size = 0;
         }
+    }
+    return 0;
+}
 
-        new_entry.buffptr = dev->partial_entry.buffptr; //Set new entry buffer
-        new_entry.size = dev->partial_entry.size; //Set new entry size
-        aesd_circular_buffer_add_entry(circular_buffer, &new_entry); //Add to circular buffer
+/*
+ * Copies the commands in the @count bytes of @from straight into the data log
+ * and commits them in place, so complete commands are never copied twice.
+ * Each pass reserves log space for the whole commands that fit in the log
+ * after @file's partial entry, which leads the first of them.  An unterminated
+ * remainder goes to the partial entry without evicting history.  Only a
+ * command, or an unterminated remainder, too large for the log fails with
+ * -EFBIG, and only if nothing was consumed before it.  Returns the number of
+ * bytes consumed from @from.  Caller must hold dev->lock.
+ */
+static ssize_t aesd_inline_write(struct aesd_dev *dev, struct aesd_file *file,
+                                 struct iov_iter *from, size_t count)
+{
+    struct aesd_buffer_entry *partial = &file->partial_entry;
+    struct aesd_buffer_entry command;
+    size_t data_size = dev->mmap_hdr->data_size;
+    size_t consumed = 0;
+    size_t terminated;
+    size_t copied;
+    size_t prefix;
+    size_t start;
+    size_t leftover;
+    size_t user_leftover;
+    size_t remaining;
+    char *buf;
+    const char *nl;
 
-        //Clear partial entry
+    while (consumed < count) {
+        remaining = count - consumed;
+        terminated = aesd_iter_terminated(from, min(remaining, data_size - partial->size));
+        if (terminated == 0) {
+            if (partial->size + remaining > data_size) {
+                return consumed > 0 ? consumed : -EFBIG; //The next command can't fit in the log
+            }
+            if (aesd_partial_reserve(partial, &file->partial_alloc, remaining)) {
+                return consumed > 0 ? consumed : -ENOMEM;
+            }
+            copied = copy_from_iter((char *)partial->buffptr + partial->size, remaining, from);
+            partial->size += copied;
+            file->partial_scanned = 0;
+            return consumed + copied;
+        }
+
+        prefix = partial->size;
+        buf = aesd_inline_reserve(dev, prefix + terminated);
+        if (prefix > 0) {
+            memcpy(buf, partial->buffptr, prefix);
+        }
+        copied = copy_from_iter(buf + prefix, terminated, from);
+        consumed += copied;
+        user_leftover = copied;
+        copied += prefix;
+        start = 0;
+        while ((nl = memchr(buf + start, '\n', copied - start)) != NULL) {
+            command.buffptr = buf + start;
+            command.size = nl - buf + 1 - start;
+            aesd_commit_entry(dev, &command);
+            start += command.size;
+        }
+        partial->size = 0;
+
+        //Log bytes after the last committed command are only left if the copy faulted or the user
+        //buffer changed since it was scanned, they go back to the partial entry
+        leftover = copied - start;
+        if (leftover > 0) {
+            if (aesd_partial_reserve(partial, &file->partial_alloc, leftover)) {
+                //Report a short write, a prefix no command was committed from is still in the partial entry
+                user_leftover = min(user_leftover, leftover);
+                iov_iter_revert(from, user_leftover);
+                partial->size = leftover - user_leftover;
+                consumed -= user_leftover;
+                return consumed > 0 ? consumed : -ENOMEM;
+            }
+            memcpy((char *)partial->buffptr, buf + start, leftover);
+            partial->size = leftover;
+            file->partial_scanned = 0;
+            return consumed;
+        }
+    }
+    return consumed;
+}
+
+/*
+ * Appends all segments of @from to the file's partial entry and commits every
+ * newline-terminated command they complete, under a single lock acquisition.
+ * With inline_data, commands are copied straight into the data log instead,
+ * see aesd_inline_write().
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_entry *partial = &file->partial_entry;
+    size_t count = iov_iter_count(from);
+    size_t bytes_written;
+    size_t partial_before;
+    ssize_t ret;
+
+    if (aesd_lock(dev, true)) {
+        trace_aesd_write(dev, count, -ERESTARTSYS);
+        return -ERESTARTSYS; //Return if lock interrupted
+    }
+
+    //Pick up a fragment left by a file that was closed mid-command, unless this file has its own
+    if (partial->size == 0 && dev->partial_entry.buffptr != NULL) {
+        aesd_partial_free(partial, &file->partial_alloc); //Empty, kept from an earlier command
+        *partial = dev->partial_entry;
+        file->partial_alloc = dev->partial_alloc;
+        file->partial_scanned = 0; //May hold a command its file couldn't store
         dev->partial_entry.buffptr = NULL;
         dev->partial_entry.size = 0;
+        dev->partial_alloc = 0;
+    }
+    partial_before = partial->size;
+
+    if (aesd_inline_data) {
+        ret = aesd_inline_write(dev, file, from, count);
+        if (ret < 0) {
+            goto out_unlock;
+        }
+        bytes_written = ret;
+        goto out;
     }
 
-    mutex_unlock(&dev->lock); //Unlock after operation
-    *f_pos += bytes_written; //Update file position
-    return bytes_written; //Return bytes written
+    //Grow the partial entry buffer
+    if (aesd_partial_reserve(partial, &file->partial_alloc, count)) {
+        ret = -ENOMEM; //Return error if allocation fails
+        goto out_unlock;
+    }
+
+    //Copy user data to buffer and update size
+    bytes_written = copy_from_iter((char *)partial->buffptr + partial->size, count, from);
+    partial->size += bytes_written;
+
+    //Only the newly written bytes, and commands a failed allocation left behind, can hold a newline
+    aesd_commit_commands(dev, file);
+
+out:
+    dev->stats.bytes_written += bytes_written;
+    dev->stats.partial_bytes += partial->size - partial_before;
+    ret = bytes_written;
+    if (bytes_written == 0 && count > 0) {
+        ret = -EFAULT; //Nothing could be copied from the user buffer
+    }
+    iocb->ki_pos += bytes_written; //Update file position
+
+out_unlock:
+    aesd_unlock(dev); //Unlock after operation
+    trace_aesd_write(dev, count, ret);
+    return ret; //Return bytes written
+}
+
+/*
+ * Moves a tailing file's absolute position to match file position @f_pos.
+ */
+static void aesd_tail_sync(struct aesd_dev *dev, struct aesd_file *file, loff_t f_pos)
+{
+    unsigned int seq;
+    uint64_t base;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        base = dev->circular_buffer.base_offset;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    WRITE_ONCE(file->tail_pos, base + f_pos);
 }
 
 //Implementing suggestion #2 for llseek
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
-    struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;   
-    struct aesd_buffer_entry *entryptr;
-    struct aesd_circular_buffer *buffer = &aesd_device.circular_buffer;
-    uint8_t index;
-    uint16_t size = 0;
-    
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS; //Return if lock interrupted
-    }
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    loff_t size;
+    unsigned int seq;
+    loff_t ret;
      
-    AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index){
-        if (entryptr->buffptr != NULL) {
-            size += entryptr->size;
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        size = aesd_circular_buffer_total_size(&dev->circular_buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    ret = fixed_size_llseek(filp, offset, whence, size);
+    if (ret >= 0) {
+        aesd_tail_sync(dev, file, ret);
+    }
+    trace_aesd_llseek(dev, offset, whence, ret);
+    return ret;
+}
+
+/*
+ * Handles AESDCHAR_IOCLAYOUT: snapshots the entry table without the lock and
+ * copies it to the user array described by *@ulayout.
+ */
+static long aesd_ioctl_layout(struct aesd_dev *dev, struct aesd_layout __user *ulayout)
+{
+    struct aesd_circular_buffer *circular_buffer = &dev->circular_buffer;
+    struct aesd_layout layout;
+    struct aesd_layout_entry *table = NULL;
+    uint32_t max_entries;
+    uint32_t slot;
+    uint32_t i;
+    unsigned int seq;
+    long ret = 0;
+
+    if (copy_from_user(&layout, ulayout, sizeof(layout)))
+        return -EFAULT;
+
+    max_entries = min(layout.max_entries, circular_buffer->capacity);
+    if (max_entries > 0) {
+        table = kvmalloc_array(max_entries, sizeof(*table), GFP_KERNEL);
+        if (!table)
+            return -ENOMEM;
+    }
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        layout.count = aesd_circular_buffer_count(circular_buffer);
+        layout.base_offset = circular_buffer->base_offset;
+        layout.total_size = circular_buffer->total_size;
+        layout.generation = dev->generation;
+        for (i = 0; i < min(layout.count, max_entries); i++) {
+            slot = (circular_buffer->out_offs + i) % circular_buffer->capacity;
+            table[i].offset = circular_buffer->entry_offset[slot];
+            table[i].size = circular_buffer->entry[slot].size;
         }
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (max_entries > 0 &&
+        copy_to_user(u64_to_user_ptr(layout.entries), table,
+                     min(layout.count, max_entries) * sizeof(*table))) {
+        ret = -EFAULT;
+    } else if (copy_to_user(ulayout, &layout, sizeof(layout))) {
+        ret = -EFAULT;
     }
-    
-    uint8_t ret = fixed_size_llseek(filp, offset, whence, size);
 
-    mutex_unlock(&dev->lock); //Unlock after operation
-    
+    kvfree(table);
     return ret;
 }
 
 static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
     struct aesd_circular_buffer *circular_buffer = &dev->circular_buffer;
     struct aesd_seekto seekto;
     struct aesd_buffer_entry *entry;
-    unsigned int i;
-    size_t offset = 0;
+    size_t entry_size = 0;
+    uint64_t entry_fpos = 0;
+    unsigned int seq;
+    uint32_t enable;
 
     //Check if the command number is in our allowed range
     if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
@@ -213,106 +945,309 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         if (copy_from_user(&seekto, (struct aesd_seekto __user *)arg, sizeof(seekto)))
             return -EFAULT;
 
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
-
-
-        //Find the buffer entry at the command index
-        entry = &circular_buffer->entry[seekto.write_cmd % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        //Find the buffer entry at the command index, counted from the oldest entry
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            entry = aesd_circular_buffer_entry_at(circular_buffer, seekto.write_cmd, &entry_fpos);
+            if (entry != NULL) {
+                entry_size = entry->size;
+            }
+        } while (read_seqcount_retry(&dev->seq, seq));
 
-        //Check if the offset is within the bounds of the command
-        if (seekto.write_cmd_offset >= entry->size) {
-            mutex_unlock(&dev->lock);
+        //Check if the command exists and the offset is within its bounds
+        if (entry == NULL || seekto.write_cmd_offset >= entry_size) {
             return -EINVAL;
         }
 
-        //Calculate the new file position
-        for (i = 0; i < seekto.write_cmd; i++) {
-            entry = &circular_buffer->entry[i % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
-            offset += entry->size;
-        }
+        filp->f_pos = entry_fpos + seekto.write_cmd_offset;
+        aesd_tail_sync(dev, file, filp->f_pos);
+        trace_aesd_ioc_seekto(dev, seekto.write_cmd, seekto.write_cmd_offset, filp->f_pos);
+        return 0;
+    }
 
-        offset += seekto.write_cmd_offset;
-        filp->f_pos = offset;
+    if (cmd == AESDCHAR_IOCTAIL) {
+        if (get_user(enable, (uint32_t __user *)arg))
+            return -EFAULT;
 
-        mutex_unlock(&dev->lock);
+        if (enable) {
+            aesd_tail_sync(dev, file, filp->f_pos);
+        }
+        WRITE_ONCE(file->tail, enable != 0);
         return 0;
     }
 
+    if (cmd == AESDCHAR_IOCLAYOUT) {
+        return aesd_ioctl_layout(dev, (struct aesd_layout __user *)arg);
+    }
+
     return -EINVAL;
 }
 
+/*
+ * Maps the header and data log read-only, see aesd_mmap.h for the layout.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    if (dev->mmap_hdr == NULL) {
+        return -ENODEV;
+    }
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return remap_vmalloc_range(vma, dev->mmap_hdr, vma->vm_pgoff);
+}
+
+static int aesd_mmap_init(struct aesd_dev *dev)
+{
+    size_t header_size;
+
+    if (aesd_mmap_size == 0) {
+        return 0;
+    }
+
+    header_size = PAGE_ALIGN(struct_size(dev->mmap_hdr, entries, dev->circular_buffer.capacity));
+    dev->mmap_hdr = vmalloc_user(header_size + PAGE_ALIGN(aesd_mmap_size));
+    if (dev->mmap_hdr == NULL) {
+        return -ENOMEM;
+    }
+
+    dev->mmap_data = (char *)dev->mmap_hdr + header_size;
+    dev->mmap_hdr->magic = AESD_MMAP_MAGIC;
+    dev->mmap_hdr->header_size = header_size;
+    dev->mmap_hdr->data_size = PAGE_ALIGN(aesd_mmap_size);
+    dev->mmap_hdr->capacity = dev->circular_buffer.capacity;
+    return 0;
+}
+
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM; //Writes never block on a full ring
+
+    poll_wait(filp, &dev->wait_queue, wait);
+    if (aesd_file_has_data(dev, file, filp->f_pos)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+static void aesd_stats_show_hist(struct seq_file *s, const char *name, const uint64_t *hist)
+{
+    unsigned int i;
+
+    seq_printf(s, "%s:\n", name);
+    for (i = 0; i < AESD_HIST_BUCKETS; i++) {
+        if (hist[i] != 0) {
+            seq_printf(s, "  %12llu %llu\n", 1ULL << i, hist[i]);
+        }
+    }
+}
+
+/*
+ * debugfs stats file, taken under the lock so the counters are consistent
+ * with each other.  Reading it doesn't count as lock traffic.
+ */
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats *stats = &dev->stats;
+
+    if (mutex_lock_interruptible(&dev->lock)) {
+        return -ERESTARTSYS;
+    }
+    seq_printf(s, "entries: %u\n", aesd_circular_buffer_count(&dev->circular_buffer));
+    seq_printf(s, "bytes_stored: %llu\n", dev->circular_buffer.total_size);
+    seq_printf(s, "evictions: %llu\n", stats->evictions);
+    seq_printf(s, "partial_bytes: %llu\n", stats->partial_bytes);
+    seq_printf(s, "bytes_written: %llu\n", stats->bytes_written);
+    seq_printf(s, "bytes_read: %lld\n", (long long)atomic64_read(&stats->bytes_read));
+    seq_printf(s, "lock_acquired: %llu\n", stats->lock_acquired);
+    seq_printf(s, "lock_contended: %llu\n", stats->lock_contended);
+    aesd_stats_show_hist(s, "lock_wait_ns", stats->lock_wait_hist);
+    aesd_stats_show_hist(s, "lock_hold_ns", stats->lock_hold_hist);
+    mutex_unlock(&dev->lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
 struct file_operations aesd_fops = {
     .owner =          THIS_MODULE,
-    .read =           aesd_read,
-    .write =          aesd_write,
+    .read_iter =      aesd_read_iter,
+    .write_iter =     aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =    copy_splice_read,
+#else
+    .splice_read =    generic_file_splice_read,
+#endif
     .open =           aesd_open,
     .release =        aesd_release,
     .llseek =         aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =           aesd_mmap,
+    .poll =           aesd_poll,
+    .fasync =         aesd_fasync,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
+/*
+ * Sets up device @index with its own ring, locks and mmap area and makes it live.
+ */
+static int aesd_dev_init(struct aesd_dev *dev, int index)
+{
+    char name[24];
+    int result;
+
+    result = aesd_circular_buffer_init_capacity(&dev->circular_buffer, aesd_ring_capacity);
+    if( result ) {
+        return result;
+    }
+    aesd_circular_buffer_set_max_bytes(&dev->circular_buffer, aesd_max_bytes);
+    result = init_srcu_struct(&dev->srcu);
+    if( result ) {
+        goto fail_buffer;
+    }
+    result = aesd_mmap_init(dev);
+    if( result ) {
+        goto fail_srcu;
+    }
+    mutex_init(&dev->lock);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    init_waitqueue_head(&dev->wait_queue);
+
+
+    result = aesd_setup_cdev(dev, index);
+    if( result ) {
+        goto fail_mmap;
+    }
+
+    //debugfs is best effort, the device works without it
+    snprintf(name, sizeof(name), "aesdchar%d", index);
+    dev->debugfs = debugfs_create_dir(name, aesd_debugfs_root);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &aesd_stats_fops);
+    return 0;
+
+fail_mmap:
+    vfree(dev->mmap_hdr);
+fail_srcu:
+    cleanup_srcu_struct(&dev->srcu);
+fail_buffer:
+    aesd_circular_buffer_free(&dev->circular_buffer);
+    return result;
+}
+
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entryptr;
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    uint32_t index;
+
+    debugfs_remove_recursive(dev->debugfs);
+    cdev_del(&dev->cdev);
+
+    //Wait for deferred frees of evicted entries, no readers remain after cdev_del
+    srcu_barrier(&dev->srcu);
+    cleanup_srcu_struct(&dev->srcu);
+     
+    AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index){
+        if (entryptr->buffptr != NULL && !aesd_inline_data) {
+            kfree(aesd_entry_data(entryptr->buffptr));
+            entryptr->size = 0;
+        }
+    }
+    aesd_circular_buffer_free(buffer);
+    aesd_partial_free(&dev->partial_entry, &dev->partial_alloc);
+    vfree(dev->mmap_hdr);
+    mutex_destroy(&dev->lock);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    int i;
+
+    if (aesd_ring_capacity == 0 || aesd_ring_capacity > AESD_MAX_RING_CAPACITY) {
+        printk(KERN_WARNING "Invalid ring_capacity %u\n", aesd_ring_capacity);
+        return -EINVAL;
+    }
+    if (aesd_nr_devs == 0 || aesd_nr_devs > AESD_MAX_DEVICES) {
+        printk(KERN_WARNING "Invalid nr_devs %u\n", aesd_nr_devs);
+        return -EINVAL;
+    }
+    if (aesd_inline_data && aesd_mmap_size == 0) {
+        printk(KERN_WARNING "inline_data needs a nonzero mmap_size\n");
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
-
-    aesd_circular_buffer_init(&aesd_device.circular_buffer);
-    mutex_init(&aesd_device.lock);
 
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto fail_region;
+    }
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
 
-    result = aesd_setup_cdev(&aesd_device);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if( result ) {
+            goto fail_devices;
+        }
+    }
+    return 0;
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+fail_devices:
+    while (--i >= 0) {
+        aesd_dev_cleanup(&aesd_devices[i]);
     }
+    debugfs_remove_recursive(aesd_debugfs_root);
+    kfree(aesd_devices);
+fail_region:
+    unregister_chrdev_region(dev, aesd_nr_devs);
     return result;
-
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    int i;
 
-    cdev_del(&aesd_device.cdev);
-
-    struct aesd_buffer_entry *entryptr;
-    struct aesd_circular_buffer *buffer = &aesd_device.circular_buffer;
-    uint8_t index;
-     
-    AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index){
-        if (entryptr->buffptr != NULL) {
-            kfree(entryptr->buffptr);
-            entryptr->size = 0;
-        }
+    for (i = 0; i < aesd_nr_devs; i++) {
+        aesd_dev_cleanup(&aesd_devices[i]);
     }
-    mutex_destroy(&aesd_device.lock);
-     
+    debugfs_remove_recursive(aesd_debugfs_root);
+    kfree(aesd_devices);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 module_init(aesd_init_module);
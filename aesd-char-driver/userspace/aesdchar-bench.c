@@ -0,0 +1,337 @@
+/**
+ * @file aesdchar-bench.c
+ * @brief Multi-threaded microbenchmark of the aesdchar file operations
+ *
+ * Runs main.c in userspace on top of kshim (see kshim/kshim.h) and drives its
+ * file_operations from writer, reader and seeker threads for a fixed time,
+ * then reports throughput per thread class and the device's debugfs stats,
+ * which include the writer lock contention histograms.
+ *
+ * Usage: aesdchar-bench [-w writers] [-r readers] [-k seekers] [-s size]
+ *                       [-m commands] [-b read_buffer] [-d seconds] [-c] [-v]
+ *                       [param=value ...]
+ * Trailing arguments are module parameters, as given to aesdchar_load.
+ * -m makes writers write that many commands per writev, one per segment,
+ * which with inline_data can be more than the data log holds.
+ * -c makes readers check that no command they read was torn by a concurrent
+ * write or skipped by a concurrent eviction, which exercises the lockless
+ * read paths.
+ */
+
+#include <getopt.h>
+#include "kshim.h"
+#include "aesdchar.h"
+#include "aesd_ioctl.h"
+
+extern struct aesd_dev *aesd_devices;
+extern struct file_operations aesd_fops;
+int aesd_init_module(void);
+void aesd_cleanup_module(void);
+
+enum bench_role {
+    ROLE_WRITER,
+    ROLE_READER,
+    ROLE_SEEKER,
+    ROLE_COUNT
+};
+
+static const char *role_names[ROLE_COUNT] = {
+    [ROLE_WRITER] = "write",
+    [ROLE_READER] = "read",
+    [ROLE_SEEKER] = "seek",
+};
+
+struct bench_thread {
+    pthread_t thread;
+    enum bench_role role;
+    unsigned int id;
+    uint64_t ops;
+    uint64_t bytes;
+};
+
+static struct inode bench_inode;
+static volatile bool bench_stop;
+static size_t command_size = 64;
+static unsigned int commands_per_write = 1;
+static size_t read_buffer = 4096;
+static bool check_data;
+static bool single_writer; // Commands then cycle through the alphabet in order
+
+static struct file *bench_open(void)
+{
+    struct file *filp = calloc(1, sizeof(*filp));
+
+    if (filp == NULL || aesd_fops.open(&bench_inode, filp) != 0) {
+        fprintf(stderr, "open failed\n");
+        exit(1);
+    }
+    return filp;
+}
+
+static void bench_close(struct file *filp)
+{
+    aesd_fops.release(&bench_inode, filp);
+    free(filp);
+}
+
+static ssize_t bench_rwv(struct file *filp, const struct iovec *iov, unsigned long nr_segs, size_t len,
+                         bool write)
+{
+    struct kiocb iocb = { .ki_filp = filp, .ki_pos = filp->f_pos };
+    struct iov_iter iter;
+    ssize_t ret;
+
+    iov_iter_init(&iter, write ? ITER_SOURCE : ITER_DEST, iov, nr_segs, len);
+    ret = write ? aesd_fops.write_iter(&iocb, &iter) : aesd_fops.read_iter(&iocb, &iter);
+    filp->f_pos = iocb.ki_pos;
+    return ret;
+}
+
+static ssize_t bench_rw(struct file *filp, void *buf, size_t len, bool write)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return bench_rwv(filp, &iov, 1, len, write);
+}
+
+/*
+ * Writes newline-terminated commands of command_size bytes, commands_per_write
+ * at a time
+ */
+static void bench_writer(struct bench_thread *t, struct file *filp)
+{
+    size_t len = command_size * commands_per_write;
+    char *commands = malloc(len);
+    struct iovec *iov = calloc(commands_per_write, sizeof(*iov));
+    unsigned int i;
+
+    for (i = 0; i < commands_per_write; i++) {
+        iov[i].iov_base = commands + i * command_size;
+        iov[i].iov_len = command_size;
+        commands[(i + 1) * command_size - 1] = '\n';
+    }
+    while (!bench_stop) {
+        for (i = 0; i < commands_per_write; i++) {
+            memset(iov[i].iov_base, 'a' + (t->id + t->ops + i) % 26, command_size - 1);
+        }
+        if (bench_rwv(filp, iov, commands_per_write, len, true) != (ssize_t)len) {
+            fprintf(stderr, "write failed\n");
+            exit(1);
+        }
+        t->ops += commands_per_write;
+        t->bytes += len;
+    }
+    free(iov);
+    free(commands);
+}
+
+/*
+ * Every command is one letter repeated and a newline, so within a read any
+ * byte after the first command boundary must repeat its predecessor or end
+ * the command, and every command after that boundary must be whole.  With a
+ * single writer consecutive commands use consecutive letters, so a read that
+ * skipped a whole command is caught too.
+ */
+static void bench_check(const char *buf, size_t len)
+{
+    const char *nl = memchr(buf, '\n', len);
+    size_t start = nl != NULL ? nl - buf + 1 : len;
+    char prev = nl != NULL && nl > buf ? nl[-1] : 0;
+    size_t i;
+
+    for (i = start; i < len; i++) {
+        if (buf[i] != '\n' && i > start && buf[i - 1] != '\n' && buf[i] != buf[i - 1]) {
+            fprintf(stderr, "torn command read at byte %zu\n", i);
+            exit(1);
+        }
+        if (buf[i] == '\n') {
+            if (i + 1 - start != command_size) {
+                fprintf(stderr, "partial command read at byte %zu\n", i);
+                exit(1);
+            }
+            if (single_writer && prev != 0 && i > start && buf[i - 1] != 'a' + (prev - 'a' + 1) % 26) {
+                fprintf(stderr, "command skipped before byte %zu\n", start);
+                exit(1);
+            }
+            prev = i > start ? buf[i - 1] : 0;
+            start = i + 1;
+        }
+    }
+}
+
+/*
+ * Reads the whole device from the start, over and over
+ */
+static void bench_reader(struct bench_thread *t, struct file *filp)
+{
+    char *buf = malloc(read_buffer);
+    ssize_t ret;
+
+    while (!bench_stop) {
+        filp->f_pos = 0;
+        while ((ret = bench_rw(filp, buf, read_buffer, false)) > 0) {
+            if (check_data) {
+                bench_check(buf, ret);
+            }
+            t->ops++;
+            t->bytes += ret;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "read failed: %zd\n", ret);
+            exit(1);
+        }
+    }
+    free(buf);
+}
+
+/*
+ * Alternates AESDCHAR_IOCSEEKTO to pseudo-random commands with llseek to the end
+ */
+static void bench_seeker(struct bench_thread *t, struct file *filp)
+{
+    struct aesd_seekto seekto = { 0 };
+    unsigned int seed = t->id;
+
+    while (!bench_stop) {
+        seekto.write_cmd = rand_r(&seed) % aesd_devices[0].circular_buffer.capacity;
+        aesd_fops.unlocked_ioctl(filp, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto);
+        aesd_fops.llseek(filp, 0, SEEK_END);
+        t->ops += 2;
+    }
+}
+
+static void *bench_thread_main(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct file *filp = bench_open();
+
+    switch (t->role) {
+    case ROLE_WRITER:
+        bench_writer(t, filp);
+        break;
+    case ROLE_READER:
+        bench_reader(t, filp);
+        break;
+    case ROLE_SEEKER:
+        bench_seeker(t, filp);
+        break;
+    default:
+        break;
+    }
+
+    bench_close(filp);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-k seekers] [-s command_size]\n"
+            "          [-m commands_per_write] [-b read_buffer] [-d seconds] [-c] [-v]\n"
+            "          [param=value ...]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int counts[ROLE_COUNT] = { [ROLE_WRITER] = 1, [ROLE_READER] = 1, [ROLE_SEEKER] = 0 };
+    struct bench_thread *threads;
+    unsigned int nr_threads = 0;
+    unsigned int role;
+    unsigned int i;
+    double seconds = 2.0;
+    uint64_t start;
+    double elapsed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:r:k:s:m:b:d:cv")) != -1) {
+        switch (opt) {
+        case 'w':
+            counts[ROLE_WRITER] = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            counts[ROLE_READER] = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            counts[ROLE_SEEKER] = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            command_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            commands_per_write = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            read_buffer = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            seconds = strtod(optarg, NULL);
+            break;
+        case 'c':
+            check_data = true;
+            break;
+        case 'v':
+            kshim_verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (command_size == 0 || commands_per_write == 0 || read_buffer == 0) {
+        usage(argv[0]);
+    }
+    single_writer = counts[ROLE_WRITER] == 1;
+    for (i = optind; i < (unsigned int)argc; i++) {
+        if (kshim_param_set(argv[i])) {
+            fprintf(stderr, "Unknown or invalid module parameter %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (aesd_init_module() != 0) {
+        fprintf(stderr, "aesd_init_module failed\n");
+        return 1;
+    }
+    bench_inode.i_cdev = &aesd_devices[0].cdev;
+
+    threads = calloc(counts[ROLE_WRITER] + counts[ROLE_READER] + counts[ROLE_SEEKER], sizeof(*threads));
+    start = ktime_get_ns();
+    for (role = 0; role < ROLE_COUNT; role++) {
+        for (i = 0; i < counts[role]; i++) {
+            threads[nr_threads].role = role;
+            threads[nr_threads].id = i;
+            pthread_create(&threads[nr_threads].thread, NULL, bench_thread_main, &threads[nr_threads]);
+            nr_threads++;
+        }
+    }
+
+    usleep(seconds * 1e6);
+    bench_stop = true;
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    elapsed = (ktime_get_ns() - start) / 1e9;
+
+    printf("%-6s %8s %14s %12s %10s\n", "op", "threads", "ops", "ops/s", "MB/s");
+    for (role = 0; role < ROLE_COUNT; role++) {
+        uint64_t ops = 0;
+        uint64_t bytes = 0;
+
+        if (counts[role] == 0) {
+            continue;
+        }
+        for (i = 0; i < nr_threads; i++) {
+            if (threads[i].role == role) {
+                ops += threads[i].ops;
+                bytes += threads[i].bytes;
+            }
+        }
+        printf("%-6s %8u %14" PRIu64 " %12.0f %10.1f\n", role_names[role], counts[role], ops,
+               ops / elapsed, bytes / elapsed / 1e6);
+    }
+    printf("\n");
+    kshim_debugfs_show(stdout);
+
+    aesd_cleanup_module();
+    free(threads);
+    return 0;
+}
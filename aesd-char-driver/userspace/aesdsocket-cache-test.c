@@ -0,0 +1,394 @@
+/**
+ * @file aesdsocket-cache-test.c
+ * @brief Checks aesdsocket's replay cache against the device it mirrors
+ *
+ * Links server/aesdsocket-cache.c with main.c on top of kshim.  open, ioctl,
+ * write, pread and send are wrapped at link time (-Wl,--wrap) so that the
+ * descriptors the cache opens reach the driver's file operations and what it
+ * sends lands in a buffer.
+ *
+ * Two connections write random chunks through aesd_cache_write, complete
+ * commands and fragments alike, interleaved with an outside writer that goes
+ * straight to the device and sometimes closes mid-command.  After every step
+ * a connection replays from a random position with aesd_cache_send and the
+ * result must match a direct read of the device byte for byte.  Run it with
+ * a small ring so most commands get evicted.  It also checks that:
+ * - a replay after writes made only through the cache reads nothing back,
+ *   i.e. the cache recognized the generation steps of those writes, which
+ *   differ with inline_data=1,
+ * - a refill that races a commit, injected from inside the cache's pread,
+ *   doesn't keep what it read.
+ *
+ * Usage: aesdsocket-cache-test [-n steps] [-s seed] [param=value ...]
+ * Trailing arguments are module parameters, as given to aesdchar_load.
+ */
+
+#include <getopt.h>
+#include <stdarg.h>
+#include "kshim.h"
+#include "aesdchar.h"
+#include "aesd_ioctl.h"
+#include "../../server/aesdsocket-cache.h"
+
+#define TEST_DEVICE "/dev/aesdchar"
+#define FAKE_FD_BASE 1000 // Descriptors from here on are device files of the table below
+#define MAX_FILES 8
+#define SEND_FD 999 // What aesd_cache_send sends to this goes to sent
+#define CONNECTIONS 2
+#define MAX_CHUNK 120
+
+extern struct aesd_dev *aesd_devices;
+extern struct file_operations aesd_fops;
+int aesd_init_module(void);
+void aesd_cleanup_module(void);
+
+int __real_open(const char *path, int flags, ...);
+int __real_ioctl(int fd, unsigned long request, ...);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+
+static struct inode test_inode;
+static struct file *files[MAX_FILES];
+static char *sent;
+static size_t sent_size;
+static size_t sent_alloc;
+static unsigned int preads;
+static bool race_next_pread; // The next pread commits a command from outside first
+static int outside_fd = -1;
+static unsigned int seed = 1;
+static unsigned int failures;
+
+static struct file *fake_file(int fd)
+{
+    if (fd >= FAKE_FD_BASE && fd < FAKE_FD_BASE + MAX_FILES) {
+        return files[fd - FAKE_FD_BASE];
+    }
+    return NULL;
+}
+
+static ssize_t file_rw(struct file *filp, void *buf, size_t len, loff_t *pos, bool write)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct kiocb iocb = { .ki_filp = filp, .ki_pos = *pos };
+    struct iov_iter iter;
+    ssize_t ret;
+
+    iov_iter_init(&iter, write ? ITER_SOURCE : ITER_DEST, &iov, 1, len);
+    ret = write ? aesd_fops.write_iter(&iocb, &iter) : aesd_fops.read_iter(&iocb, &iter);
+    *pos = iocb.ki_pos;
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+static int device_open(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_FILES; i++) {
+        if (files[i] == NULL) {
+            files[i] = calloc(1, sizeof(*files[i]));
+            if (files[i] == NULL || aesd_fops.open(&test_inode, files[i]) != 0) {
+                fprintf(stderr, "open failed\n");
+                exit(1);
+            }
+            return FAKE_FD_BASE + i;
+        }
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+static void device_close(int fd)
+{
+    struct file *filp = fake_file(fd);
+
+    aesd_fops.release(&test_inode, filp);
+    free(filp);
+    files[fd - FAKE_FD_BASE] = NULL;
+}
+
+int __wrap_open(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode;
+
+    if (strcmp(path, TEST_DEVICE) == 0) {
+        return device_open();
+    }
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+    struct file *filp = fake_file(fd);
+    unsigned long arg;
+    long ret;
+    va_list ap;
+
+    va_start(ap, request);
+    arg = va_arg(ap, unsigned long);
+    va_end(ap);
+    if (filp == NULL) {
+        return __real_ioctl(fd, request, arg);
+    }
+    ret = aesd_fops.unlocked_ioctl(filp, request, arg);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+    struct file *filp = fake_file(fd);
+
+    if (filp == NULL) {
+        return __real_write(fd, buf, count);
+    }
+    return file_rw(filp, (void *)buf, count, &filp->f_pos, true);
+}
+
+static void outside_write(bool terminated);
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    struct file *filp = fake_file(fd);
+    loff_t pos = offset;
+
+    if (filp == NULL) {
+        return __real_pread(fd, buf, count, offset);
+    }
+    preads++;
+    if (race_next_pread) {
+        // The cache has just read the layout, commit behind its back
+        race_next_pread = false;
+        outside_write(true);
+    }
+    return file_rw(filp, buf, count, &pos, false);
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags)
+{
+    if (fd != SEND_FD) {
+        return __real_send(fd, buf, len, flags);
+    }
+    if (sent_size + len > sent_alloc) {
+        sent_alloc = (sent_size + len) * 2;
+        sent = realloc(sent, sent_alloc);
+        if (sent == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(sent + sent_size, buf, len);
+    sent_size += len;
+    return len;
+}
+
+/* Fills buf with len random letters, ending in a newline if terminated, and maybe holding
+ * more newlines before that
+ */
+static void random_chunk(char *buf, size_t len, bool terminated)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = rand_r(&seed) % 12 == 0 ? '\n' : 'a' + rand_r(&seed) % 26;
+    }
+    if (terminated) {
+        buf[len - 1] = '\n';
+    } else {
+        for (i = 0; i < len; i++) {
+            if (buf[i] == '\n') {
+                buf[i] = '-';
+            }
+        }
+    }
+}
+
+/* Writes to the device without the cache knowing.  Unterminated writes sometimes close
+ * the file, parking the fragment for the next file that writes.
+ */
+static void outside_write(bool terminated)
+{
+    char buf[MAX_CHUNK];
+    size_t len = 1 + rand_r(&seed) % MAX_CHUNK;
+
+    random_chunk(buf, len, terminated);
+    if (__wrap_write(outside_fd, buf, len) != (ssize_t)len) {
+        fprintf(stderr, "outside write failed\n");
+        exit(1);
+    }
+    if (!terminated && rand_r(&seed) % 2 == 0) {
+        device_close(outside_fd);
+        outside_fd = device_open();
+    }
+}
+
+/* Reads the device from file position pos to its end */
+static size_t device_read(char **buf, size_t *alloc, loff_t pos)
+{
+    size_t size = 0;
+    ssize_t ret;
+
+    for (;;) {
+        if (size + 4096 > *alloc) {
+            *alloc = (size + 4096) * 2;
+            *buf = realloc(*buf, *alloc);
+            if (*buf == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        ret = file_rw(files[0], *buf + size, 4096, &pos, false);
+        if (ret <= 0) {
+            break;
+        }
+        size += ret;
+    }
+    return size;
+}
+
+static void check(bool ok, const char *what, unsigned int step)
+{
+    if (!ok) {
+        printf("step %u: %s\n", step, what);
+        failures++;
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n steps] [-s seed] [param=value ...]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int conn_fd[CONNECTIONS];
+    struct aesd_cache_pending pending[CONNECTIONS];
+    char *cache_buffer = NULL;
+    size_t cache_buffer_size = 0;
+    char *expected = NULL;
+    size_t expected_alloc = 0;
+    size_t expected_size;
+    char chunk[MAX_CHUNK];
+    struct aesd_buffer_entry *partial;
+    unsigned int steps = 20000;
+    unsigned int step;
+    unsigned int local_steps = 0;
+    unsigned int served_local = 0;
+    unsigned int races = 0;
+    unsigned int before;
+    unsigned int action;
+    unsigned int c;
+    bool only_cache_writes = false; // Nothing but aesd_cache_write changed the device since the last replay
+    size_t len;
+    uint64_t pos;
+    ssize_t ret;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            steps = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        if (kshim_param_set(argv[i])) {
+            fprintf(stderr, "Unknown or invalid module parameter %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (aesd_init_module() != 0) {
+        fprintf(stderr, "aesd_init_module failed\n");
+        return 1;
+    }
+    test_inode.i_cdev = &aesd_devices[0].cdev;
+
+    device_open(); // files[0], for the direct reads
+    outside_fd = device_open();
+    aesd_cache_init(TEST_DEVICE);
+    for (c = 0; c < CONNECTIONS; c++) {
+        conn_fd[c] = open(TEST_DEVICE, O_RDWR);
+        memset(&pending[c], 0, sizeof(pending[c]));
+    }
+
+    for (step = 0; step < steps; step++) {
+        action = rand_r(&seed) % 10;
+        c = rand_r(&seed) % CONNECTIONS;
+        if (action < 7) {
+            // The cache only knows the commands a write completes while its copy of the connection's
+            // fragment matches the device's, which stops holding once the connection adopts a fragment
+            // parked by a closed file, until that fragment is committed
+            partial = &((struct aesd_file *)fake_file(conn_fd[c])->private_data)->partial_entry;
+            only_cache_writes = only_cache_writes && partial->size == pending[c].size &&
+                                (partial->size > 0 || aesd_devices[0].partial_entry.buffptr == NULL);
+            len = 1 + rand_r(&seed) % MAX_CHUNK;
+            random_chunk(chunk, len, rand_r(&seed) % 3 != 0);
+            ret = aesd_cache_write(conn_fd[c], chunk, len, &pending[c]);
+            check(ret == (ssize_t)len, "cache write failed", step);
+        } else if (action < 9) {
+            outside_write(rand_r(&seed) % 3 != 0);
+            only_cache_writes = false;
+        } else {
+            outside_write(true);
+            race_next_pread = true;
+            only_cache_writes = false;
+        }
+
+        expected_size = device_read(&expected, &expected_alloc, 0);
+        pos = rand_r(&seed) % (expected_size + 10);
+        before = preads;
+        sent_size = 0;
+        ret = aesd_cache_send(SEND_FD, pos, &cache_buffer, &cache_buffer_size);
+        if (race_next_pread) {
+            race_next_pread = false; // The cache was current, nothing raced
+        } else if (action == 9) {
+            races++;
+        }
+        expected_size = device_read(&expected, &expected_alloc, pos);
+        check(ret >= 0, "replay not served from the cache", step);
+        check(ret < 0 || ((size_t)ret == expected_size && sent_size == expected_size &&
+                          memcmp(sent, expected, expected_size) == 0), "replay differs from the device", step);
+        if (only_cache_writes) {
+            local_steps++;
+            served_local += preads == before;
+            check(preads == before, "replay after a cache write read the device", step);
+        }
+        only_cache_writes = ret >= 0;
+    }
+
+    printf("%u steps, %u replays after cache writes served without reading, %u raced refills, %u failures\n",
+           steps, served_local, races, failures);
+    check(local_steps > 0 && races > 0, "nothing was exercised", step);
+
+    for (c = 0; c < CONNECTIONS; c++) {
+        aesd_cache_pending_free(&pending[c]);
+    }
+    for (i = 0; i < MAX_FILES; i++) {
+        if (files[i] != NULL) {
+            device_close(FAKE_FD_BASE + i); // Including the cache's own
+        }
+    }
+    free(cache_buffer);
+    free(expected);
+    free(sent);
+    aesd_cleanup_module();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,467 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Microbenchmarks of aesd_circular_buffer_add_entry and find_entry_offset_for_fpos
+ *
+ * Runs every combination of ring capacity, entry size distribution and, for
+ * lookups, access pattern, and reports ns/op plus last level cache misses
+ * per op when perf_event_open is available.  Each benchmark is run -r times
+ * (default 7) after an untimed warm-up run, and reports the fastest run, the
+ * median run and its spread: how far the median sits above the fastest, in
+ * percent.
+ *
+ * Usage: circular-buffer-bench [-q] [-r repeats] [-j out.json] [-b baseline.json] [-t percent] [-f]
+ * -j writes the results as JSON, to be kept as a baseline.  -b compares against
+ * such a baseline and reports the benchmarks that regressed: both their fastest
+ * and their median run are slower than in the baseline by more than a
+ * threshold.  The threshold is three times the larger spread of the two
+ * measurements, and at least -t percent (default 10), so a noisy benchmark
+ * needs a proportionally larger slowdown to be reported.  Repeats within one
+ * process miss the noise between processes, such as other load on a shared
+ * machine, so a report is only a hint.  -f also exits with 1 on any
+ * regression, for quiet machines.  -q makes every benchmark run shorter.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "aesd-circular-buffer.h"
+
+#define BENCH_SAMPLES (1 << 16)     /* Precomputed sizes and offsets, a power of two */
+#define BENCH_MAX_RESULTS 64
+#define BENCH_MAX_REPEATS 31
+#define BENCH_NOISE_FACTOR 3        /* Threshold in multiples of the measured spread */
+
+enum bench_sizes {
+    SIZES_FIXED,            /* Every command 64 bytes */
+    SIZES_UNIFORM,          /* 1 to 1024 bytes */
+    SIZES_BIMODAL,          /* Mostly short commands with an occasional 4 KiB one */
+    SIZES_COUNT
+};
+
+enum bench_pattern {
+    PATTERN_SEQUENTIAL,     /* Walking the whole history in order, like a full read */
+    PATTERN_RANDOM,         /* Uniform over the history, like seeks */
+    PATTERN_TAIL,           /* Within the newest 5% of bytes, like readers following the end */
+    PATTERN_COUNT
+};
+
+static const char *size_names[SIZES_COUNT] = {
+    [SIZES_FIXED] = "fixed",
+    [SIZES_UNIFORM] = "uniform",
+    [SIZES_BIMODAL] = "bimodal",
+};
+
+static const char *pattern_names[PATTERN_COUNT] = {
+    [PATTERN_SEQUENTIAL] = "sequential",
+    [PATTERN_RANDOM] = "random",
+    [PATTERN_TAIL] = "tail",
+};
+
+static const uint32_t capacities[] = { 10, 64, 1024, 16384 };
+
+struct bench_result {
+    char name[64];
+    double runs[BENCH_MAX_REPEATS];  /* ns/op of every timed run */
+    unsigned int nr_runs;
+    double ns_per_op;       /* Fastest run */
+    double median_ns_per_op;
+    double spread_pct;      /* (median - fastest) / fastest, in percent */
+    double misses_per_op;   /* Negative if not measured */
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static unsigned int nr_results;
+static uint64_t bench_ops = 1 << 21;
+static int bench_repeats = 7;
+static int perf_fd = -1;
+static size_t sizes[BENCH_SAMPLES];
+static uint64_t offsets[BENCH_SAMPLES];
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Opens a counter of this thread's last level cache misses, or leaves perf_fd at -1
+ */
+static void bench_perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0) {
+        fprintf(stderr, "perf_event_open: %s, cache misses not measured\n", strerror(errno));
+    }
+}
+
+static void bench_perf_start(void)
+{
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static double bench_perf_stop(uint64_t ops)
+{
+    uint64_t misses;
+
+    if (perf_fd < 0) {
+        return -1;
+    }
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+        return -1;
+    }
+    return (double)misses / ops;
+}
+
+static struct bench_result *bench_begin(const char *name)
+{
+    struct bench_result *result = &results[nr_results++];
+
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->nr_runs = 0;
+    result->ns_per_op = 0;
+    return result;
+}
+
+/*
+ * Ends run @run of bench_ops operations started at @start_ns.  Run -1 is the
+ * warm-up and isn't recorded.  Cache misses are kept from the fastest run.
+ */
+static void bench_end_run(struct bench_result *result, int run, uint64_t start_ns)
+{
+    double ns_per_op = (double)(bench_now_ns() - start_ns) / bench_ops;
+    double misses = bench_perf_stop(bench_ops);
+
+    if (run < 0) {
+        return;
+    }
+    result->runs[result->nr_runs++] = ns_per_op;
+    if (result->ns_per_op == 0 || ns_per_op < result->ns_per_op) {
+        result->ns_per_op = ns_per_op;
+        result->misses_per_op = misses;
+    }
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Computes the median and spread of the recorded runs and prints the result
+ */
+static void bench_finish(struct bench_result *result)
+{
+    double sorted[BENCH_MAX_REPEATS];
+
+    memcpy(sorted, result->runs, result->nr_runs * sizeof(sorted[0]));
+    qsort(sorted, result->nr_runs, sizeof(sorted[0]), bench_cmp_double);
+    result->median_ns_per_op = sorted[result->nr_runs / 2];
+    result->spread_pct = (result->median_ns_per_op - sorted[0]) / sorted[0] * 100;
+
+    printf("%-36s %10.1f ns/op  median %10.1f  spread %5.1f%%", result->name, result->ns_per_op,
+           result->median_ns_per_op, result->spread_pct);
+    if (result->misses_per_op >= 0) {
+        printf(" %10.3f misses/op", result->misses_per_op);
+    }
+    printf("\n");
+}
+
+static void bench_fill_sizes(enum bench_sizes dist, unsigned int seed)
+{
+    unsigned int i;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        switch (dist) {
+        case SIZES_FIXED:
+            sizes[i] = 64;
+            break;
+        case SIZES_UNIFORM:
+            sizes[i] = 1 + rand_r(&seed) % 1024;
+            break;
+        default:
+            sizes[i] = rand_r(&seed) % 16 == 0 ? 4096 : 16 + rand_r(&seed) % 48;
+            break;
+        }
+    }
+}
+
+static void bench_fill_offsets(enum bench_pattern pattern, uint64_t total_size, unsigned int seed)
+{
+    uint64_t tail = total_size / 20 > 0 ? total_size / 20 : 1;
+    uint64_t step = total_size / BENCH_SAMPLES > 0 ? total_size / BENCH_SAMPLES : 1;
+    unsigned int i;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        uint64_t r = ((uint64_t)rand_r(&seed) << 31) ^ rand_r(&seed);
+
+        switch (pattern) {
+        case PATTERN_SEQUENTIAL:
+            offsets[i] = (i * step) % total_size;
+            break;
+        case PATTERN_RANDOM:
+            offsets[i] = r % total_size;
+            break;
+        default:
+            offsets[i] = total_size - 1 - r % tail;
+            break;
+        }
+    }
+}
+
+/*
+ * Adds to a full ring, so every add also evicts, the steady state of the driver
+ */
+static void bench_add(struct aesd_circular_buffer *buffer, const char *name)
+{
+    struct bench_result *result = bench_begin(name);
+    struct aesd_buffer_entry entry = { .buffptr = "" };
+    uint64_t start;
+    uint64_t i;
+    int run;
+
+    for (i = 0; i < buffer->capacity; i++) {
+        entry.size = sizes[i & (BENCH_SAMPLES - 1)];
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+
+    for (run = -1; run < bench_repeats; run++) {
+        bench_perf_start();
+        start = bench_now_ns();
+        for (i = 0; i < bench_ops; i++) {
+            entry.size = sizes[i & (BENCH_SAMPLES - 1)];
+            aesd_circular_buffer_add_entry(buffer, &entry);
+        }
+        bench_end_run(result, run, start);
+    }
+    bench_finish(result);
+}
+
+static void bench_find(struct aesd_circular_buffer *buffer, const char *name)
+{
+    struct bench_result *result = bench_begin(name);
+    size_t entry_offset;
+    uintptr_t sink = 0;
+    uint64_t start;
+    uint64_t i;
+    int run;
+
+    for (run = -1; run < bench_repeats; run++) {
+        bench_perf_start();
+        start = bench_now_ns();
+        for (i = 0; i < bench_ops; i++) {
+            sink += (uintptr_t)aesd_circular_buffer_find_entry_offset_for_fpos(buffer,
+                        offsets[i & (BENCH_SAMPLES - 1)], &entry_offset) + entry_offset;
+        }
+        bench_end_run(result, run, start);
+    }
+    bench_finish(result);
+    if (sink == 1) {
+        printf("\n"); //Keeps the lookups from being optimized out
+    }
+}
+
+static void bench_write_json(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    unsigned int i;
+
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(fp, "{\n  \"benchmarks\": [");
+    for (i = 0; i < nr_results; i++) {
+        fprintf(fp, "%s\n    {\"name\": \"%s\", \"ns_per_op\": %.2f, \"median_ns_per_op\": %.2f, "
+                "\"spread_pct\": %.2f", i == 0 ? "" : ",", results[i].name, results[i].ns_per_op,
+                results[i].median_ns_per_op, results[i].spread_pct);
+        if (results[i].misses_per_op >= 0) {
+            fprintf(fp, ", \"cache_misses_per_op\": %.4f", results[i].misses_per_op);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+}
+
+/*
+ * Returns the number following "@param field": in the JSON object starting at @param object,
+ * or -1 if the object has no such field
+ */
+static double bench_json_field(const char *object, const char *field)
+{
+    const char *end = strchr(object, '}');
+    const char *found = strstr(object, field);
+
+    if (found == NULL || (end != NULL && found > end)) {
+        return -1;
+    }
+    return strtod(found + strlen(field), NULL);
+}
+
+/*
+ * Compares results with the benchmarks of the same names in a file written by bench_write_json(),
+ * see the top of the file for when a benchmark counts as regressed
+ * @return the number of benchmarks that regressed, with a threshold of at least @param tolerance percent
+ */
+static unsigned int bench_compare(const char *path, double tolerance)
+{
+    char key[96];
+    char *json;
+    char *found;
+    long len;
+    unsigned int regressions = 0;
+    unsigned int i;
+    double baseline;
+    double baseline_median;
+    double noise;
+    double threshold;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    json = calloc(1, len + 1);
+    if (json == NULL || fread(json, 1, len, fp) != (size_t)len) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        exit(1);
+    }
+    fclose(fp);
+
+    printf("\nAgainst %s:\n", path);
+    for (i = 0; i < nr_results; i++) {
+        snprintf(key, sizeof(key), "\"name\": \"%s\"", results[i].name);
+        found = strstr(json, key);
+        if (found == NULL) {
+            printf("%-36s not in baseline\n", results[i].name);
+            continue;
+        }
+        baseline = bench_json_field(found, "\"ns_per_op\":");
+        baseline_median = bench_json_field(found, "\"median_ns_per_op\":");
+        noise = bench_json_field(found, "\"spread_pct\":");
+        if (baseline <= 0 || baseline_median <= 0 || noise < 0) {
+            printf("%-36s no median and spread in baseline, record it again\n", results[i].name);
+            continue;
+        }
+        if (results[i].spread_pct > noise) {
+            noise = results[i].spread_pct;
+        }
+        threshold = BENCH_NOISE_FACTOR * noise > tolerance ? BENCH_NOISE_FACTOR * noise : tolerance;
+        if (results[i].ns_per_op > baseline * (1 + threshold / 100) &&
+            results[i].median_ns_per_op > baseline_median * (1 + threshold / 100)) {
+            printf("%-36s %10.1f ns/op (median %.1f), baseline %.1f (median %.1f), threshold %.0f%%: REGRESSION\n",
+                   results[i].name, results[i].ns_per_op, results[i].median_ns_per_op, baseline,
+                   baseline_median, threshold);
+            regressions++;
+        }
+    }
+    printf("%u regression%s, thresholds at least %.0f%%\n", regressions, regressions == 1 ? "" : "s",
+           tolerance);
+    free(json);
+    return regressions;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-q] [-r repeats] [-j out.json] [-b baseline.json] [-t percent] [-f]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct aesd_circular_buffer buffer;
+    const char *json_path = NULL;
+    const char *baseline_path = NULL;
+    double tolerance = 10;
+    bool fail_on_regression = false;
+    char name[64];
+    unsigned int c;
+    int dist;
+    int pattern;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qr:j:b:t:f")) != -1) {
+        switch (opt) {
+        case 'q':
+            bench_ops = 1 << 18;
+            break;
+        case 'r':
+            bench_repeats = atoi(optarg);
+            if (bench_repeats < 1 || bench_repeats > BENCH_MAX_REPEATS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 't':
+            tolerance = strtod(optarg, NULL);
+            break;
+        case 'f':
+            fail_on_regression = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    bench_perf_open();
+    for (c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        for (dist = 0; dist < SIZES_COUNT; dist++) {
+            if (aesd_circular_buffer_init_capacity(&buffer, capacities[c]) != 0) {
+                fprintf(stderr, "aesd_circular_buffer_init_capacity failed\n");
+                return 1;
+            }
+            bench_fill_sizes(dist, c * SIZES_COUNT + dist + 1);
+            snprintf(name, sizeof(name), "add/%s/%u", size_names[dist], capacities[c]);
+            bench_add(&buffer, name);
+
+            for (pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+                bench_fill_offsets(pattern, aesd_circular_buffer_total_size(&buffer), pattern + 1);
+                snprintf(name, sizeof(name), "find/%s/%s/%u", pattern_names[pattern], size_names[dist],
+                         capacities[c]);
+                bench_find(&buffer, name);
+            }
+            aesd_circular_buffer_free(&buffer);
+        }
+    }
+
+    if (json_path != NULL) {
+        bench_write_json(json_path);
+    }
+    if (baseline_path != NULL && bench_compare(baseline_path, tolerance) > 0 && fail_on_regression) {
+        return 1;
+    }
+    return 0;
+}
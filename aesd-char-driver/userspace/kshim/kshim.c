@@ -0,0 +1,354 @@
+/*
+ * kshim.c
+ *
+ *  @brief Out of line parts of the userspace kernel shim, see kshim.h
+ */
+
+#include <stdarg.h>
+#include <inttypes.h>
+#include <sched.h>
+#include "kshim.h"
+
+#define KSHIM_MAX_PARAMS 32
+#define KSHIM_MAX_DEBUGFS 64
+
+bool kshim_verbose;
+
+struct kshim_param {
+    const char *name;
+    const char *type;
+    void *value;
+};
+
+static struct kshim_param params[KSHIM_MAX_PARAMS];
+static unsigned int nr_params;
+
+struct kshim_debugfs_file {
+    struct dentry dentry;
+    void *data;
+    const struct file_operations *fops;
+};
+
+static struct kshim_debugfs_file debugfs_files[KSHIM_MAX_DEBUGFS];
+static unsigned int nr_debugfs_files;
+static pthread_mutex_t debugfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void printk(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!kshim_verbose) {
+        return;
+    }
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void kshim_param_register(const char *name, const char *type, void *value)
+{
+    if (nr_params < KSHIM_MAX_PARAMS) {
+        params[nr_params++] = (struct kshim_param) { name, type, value };
+    }
+}
+
+int kshim_param_set(const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+    unsigned long long value;
+    unsigned int i;
+    char *end;
+
+    if (eq == NULL) {
+        return -EINVAL;
+    }
+    value = strtoull(eq + 1, &end, 0);
+    if (*end != '\0' || end == eq + 1) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nr_params; i++) {
+        if (strlen(params[i].name) != (size_t)(eq - arg) || strncmp(params[i].name, arg, eq - arg)) {
+            continue;
+        }
+        if (!strcmp(params[i].type, "bool")) {
+            *(bool *)params[i].value = value != 0;
+        } else if (!strcmp(params[i].type, "uint")) {
+            *(unsigned int *)params[i].value = value;
+        } else if (!strcmp(params[i].type, "ulong")) {
+            *(unsigned long *)params[i].value = value;
+        } else {
+            return -EINVAL;
+        }
+        return 0;
+    }
+    return -EINVAL;
+}
+
+size_t kshim_iter_copy(struct iov_iter *i, void *buf, size_t n, bool to_iter)
+{
+    size_t done = 0;
+    size_t chunk;
+    char *seg;
+
+    while (done < n && i->count > 0) {
+        chunk = min(n - done, i->iov->iov_len - i->iov_offset);
+        seg = (char *)i->iov->iov_base + i->iov_offset;
+        if (to_iter) {
+            memcpy(seg, (char *)buf + done, chunk);
+        } else {
+            memcpy((char *)buf + done, seg, chunk);
+        }
+        done += chunk;
+        i->iov_offset += chunk;
+        i->count -= chunk;
+        if (i->iov_offset == i->iov->iov_len) {
+            i->iov++;
+            i->nr_segs--;
+            i->iov_offset = 0;
+        }
+    }
+    return done;
+}
+
+void iov_iter_advance(struct iov_iter *i, size_t n)
+{
+    size_t chunk;
+
+    while (n > 0 && i->count > 0) {
+        chunk = min(n, i->iov->iov_len - i->iov_offset);
+        n -= chunk;
+        i->iov_offset += chunk;
+        i->count -= chunk;
+        if (i->iov_offset == i->iov->iov_len) {
+            i->iov++;
+            i->nr_segs--;
+            i->iov_offset = 0;
+        }
+    }
+}
+
+void iov_iter_revert(struct iov_iter *i, size_t n)
+{
+    size_t chunk;
+
+    i->count += n;
+    while (n > 0) {
+        if (i->iov_offset == 0) {
+            i->iov--;
+            i->nr_segs++;
+            i->iov_offset = i->iov->iov_len;
+        }
+        chunk = min(n, i->iov_offset);
+        i->iov_offset -= chunk;
+        n -= chunk;
+    }
+}
+
+loff_t fixed_size_llseek(struct file *filp, loff_t offset, int whence, loff_t size)
+{
+    loff_t pos;
+
+    switch (whence) {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = filp->f_pos + offset;
+        break;
+    case SEEK_END:
+        pos = size + offset;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (pos < 0 || pos > size) {
+        return -EINVAL;
+    }
+    filp->f_pos = pos;
+    return pos;
+}
+
+/*
+ * SRCU: readers share a writer-preferring rwlock.  call_srcu() only queues
+ * the callback, as in the kernel it may be called where blocking would
+ * deadlock.  A reclaimer thread takes the lock for writing, which waits out
+ * every reader that could still see the queued objects, then runs them.
+ */
+static void *srcu_reclaimer(void *arg)
+{
+    struct srcu_struct *ssp = arg;
+    struct rcu_head *head;
+    struct rcu_head *next;
+    unsigned long count;
+
+    pthread_mutex_lock(&ssp->pending_lock);
+    while (true) {
+        while (ssp->pending == NULL && !ssp->stop) {
+            pthread_cond_wait(&ssp->pending_cond, &ssp->pending_lock);
+        }
+        if (ssp->pending == NULL) {
+            break;
+        }
+        head = ssp->pending;
+        ssp->pending = NULL;
+        pthread_mutex_unlock(&ssp->pending_lock);
+
+        pthread_rwlock_wrlock(&ssp->readers);
+        pthread_rwlock_unlock(&ssp->readers);
+        for (count = 0; head != NULL; head = next, count++) {
+            next = head->next;
+            head->func(head);
+        }
+
+        pthread_mutex_lock(&ssp->pending_lock);
+        ssp->completed += count;
+        pthread_cond_broadcast(&ssp->pending_cond);
+    }
+    pthread_mutex_unlock(&ssp->pending_lock);
+    return NULL;
+}
+
+int init_srcu_struct(struct srcu_struct *ssp)
+{
+    pthread_rwlockattr_t attr;
+
+    memset(ssp, 0, sizeof(*ssp));
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ssp->readers, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&ssp->pending_lock, NULL);
+    pthread_cond_init(&ssp->pending_cond, NULL);
+    return -pthread_create(&ssp->reclaimer, NULL, srcu_reclaimer, ssp);
+}
+
+int srcu_read_lock(struct srcu_struct *ssp)
+{
+    pthread_rwlock_rdlock(&ssp->readers);
+    return 0;
+}
+
+void srcu_read_unlock(struct srcu_struct *ssp, int idx)
+{
+    pthread_rwlock_unlock(&ssp->readers);
+}
+
+void call_srcu(struct srcu_struct *ssp, struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    head->func = func;
+    pthread_mutex_lock(&ssp->pending_lock);
+    head->next = ssp->pending;
+    ssp->pending = head;
+    ssp->queued++;
+    pthread_cond_broadcast(&ssp->pending_cond);
+    pthread_mutex_unlock(&ssp->pending_lock);
+}
+
+void srcu_barrier(struct srcu_struct *ssp)
+{
+    unsigned long target;
+
+    pthread_mutex_lock(&ssp->pending_lock);
+    target = ssp->queued;
+    while (ssp->completed < target) {
+        pthread_cond_wait(&ssp->pending_cond, &ssp->pending_lock);
+    }
+    pthread_mutex_unlock(&ssp->pending_lock);
+}
+
+void cleanup_srcu_struct(struct srcu_struct *ssp)
+{
+    pthread_mutex_lock(&ssp->pending_lock);
+    ssp->stop = true;
+    pthread_cond_broadcast(&ssp->pending_cond);
+    pthread_mutex_unlock(&ssp->pending_lock);
+    pthread_join(ssp->reclaimer, NULL);
+
+    pthread_rwlock_destroy(&ssp->readers);
+    pthread_mutex_destroy(&ssp->pending_lock);
+    pthread_cond_destroy(&ssp->pending_cond);
+}
+
+void seq_printf(struct seq_file *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(s->out, fmt, ap);
+    va_end(ap);
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+    struct dentry *dentry = calloc(1, sizeof(*dentry));
+
+    if (dentry != NULL &&
+        snprintf(dentry->name, sizeof(dentry->name), "%s%s%s", parent != NULL ? parent->name : "",
+                 parent != NULL ? "/" : "", name) >= (int)sizeof(dentry->name)) {
+        free(dentry); //Name too long
+        dentry = NULL;
+    }
+    return dentry;
+}
+
+struct dentry *debugfs_create_file(const char *name, unsigned short mode, struct dentry *parent,
+                                   void *data, const struct file_operations *fops)
+{
+    struct kshim_debugfs_file *file = NULL;
+
+    pthread_mutex_lock(&debugfs_lock);
+    if (nr_debugfs_files < KSHIM_MAX_DEBUGFS &&
+        snprintf(debugfs_files[nr_debugfs_files].dentry.name, sizeof(file->dentry.name), "%s/%s",
+                 parent != NULL ? parent->name : "", name) < (int)sizeof(file->dentry.name)) {
+        file = &debugfs_files[nr_debugfs_files++];
+        file->data = data;
+        file->fops = fops;
+    }
+    pthread_mutex_unlock(&debugfs_lock);
+    return file != NULL ? &file->dentry : NULL;
+}
+
+/*
+ * Directories are freed, files under them are forgotten by prefix
+ */
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+    size_t len;
+    unsigned int i;
+
+    if (dentry == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&debugfs_lock);
+    len = strlen(dentry->name);
+    for (i = 0; i < nr_debugfs_files; i++) {
+        if (!strncmp(debugfs_files[i].dentry.name, dentry->name, len) &&
+            debugfs_files[i].dentry.name[len] == '/') {
+            debugfs_files[i] = debugfs_files[--nr_debugfs_files];
+            i--;
+        }
+    }
+    pthread_mutex_unlock(&debugfs_lock);
+
+    if (dentry < &debugfs_files[0].dentry || dentry > &debugfs_files[KSHIM_MAX_DEBUGFS - 1].dentry) {
+        free(dentry);
+    }
+}
+
+void kshim_debugfs_show(FILE *out)
+{
+    struct seq_file s = { .out = out };
+    unsigned int i;
+
+    pthread_mutex_lock(&debugfs_lock);
+    for (i = 0; i < nr_debugfs_files; i++) {
+        fprintf(out, "== %s\n", debugfs_files[i].dentry.name);
+        if (debugfs_files[i].fops->kshim_show != NULL) {
+            s.private = debugfs_files[i].data;
+            debugfs_files[i].fops->kshim_show(&s, NULL);
+        }
+    }
+    pthread_mutex_unlock(&debugfs_lock);
+}
@@ -0,0 +1,451 @@
+/*
+ * kshim.h
+ *
+ *  @brief Userspace stand-ins for the kernel APIs used by the aesdchar driver
+ *
+ * Lets main.c and aesd-circular-buffer.c be compiled unmodified as a normal
+ * program with -D__KERNEL__ -Ikshim, so the file operations can be run and
+ * benchmarked without loading the module.  The headers under kshim/linux
+ * and friends all resolve to this file.
+ *
+ * "User" pointers are plain pointers, mutexes are pthread mutexes, and SRCU
+ * is a reader-writer lock with batched callbacks, see kshim.c.  Only what
+ * the driver uses is provided.
+ */
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Compiler and module annotations
+ */
+#define __user
+#define __init
+#define __exit
+#define likely(x) (x)
+#define unlikely(x) (x)
+#define THIS_MODULE NULL
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_init(fn)
+#define module_exit(fn)
+#define S_IRUGO 0444
+
+#define ERESTARTSYS 512
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+/*
+ * Module parameters register themselves at startup so that a harness can
+ * set them by name, see kshim_param_set()
+ */
+void kshim_param_register(const char *name, const char *type, void *value);
+#define module_param_named(name, value, type, perm) \
+    static void __attribute__((constructor)) kshim_param_##name(void) \
+    { \
+        kshim_param_register(#name, #type, &(value)); \
+    }
+
+/*
+ * Parses a "name=value" module parameter, as passed to insmod.
+ * @return 0 on success, -EINVAL for an unknown name or bad value
+ */
+int kshim_param_set(const char *arg);
+
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+extern bool kshim_verbose;
+void printk(const char *fmt, ...);
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max3(a, b, c) max(max(a, b), c)
+#define ilog2(n) (63 - __builtin_clzll((unsigned long long)(n)))
+#define struct_size(p, member, n) (sizeof(*(p)) + sizeof((p)->member[0]) * (n))
+#define u64_to_user_ptr(x) ((void *)(uintptr_t)(x))
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 6, 0)
+
+/*
+ * Memory ordering
+ */
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+typedef struct { long long counter; } atomic64_t;
+
+static inline void atomic64_add(long long v, atomic64_t *a)
+{
+    __atomic_fetch_add(&a->counter, v, __ATOMIC_RELAXED);
+}
+
+static inline long long atomic64_read(atomic64_t *a)
+{
+    return __atomic_load_n(&a->counter, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Allocation
+ */
+#define GFP_KERNEL 0
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+static inline void *kmalloc(size_t size, int flags) { return malloc(size); }
+static inline void *kzalloc(size_t size, int flags) { return calloc(1, size); }
+static inline void *kcalloc(size_t n, size_t size, int flags) { return calloc(n, size); }
+static inline void *krealloc(const void *p, size_t size, int flags) { return realloc((void *)p, size); }
+static inline void kfree(const void *p) { free((void *)p); }
+static inline void *kvcalloc(size_t n, size_t size, int flags) { return calloc(n, size); }
+static inline void *kvmalloc_array(size_t n, size_t size, int flags) { return calloc(n, size); }
+static inline void kvfree(const void *p) { free((void *)p); }
+static inline void *vmalloc_user(unsigned long size) { return calloc(1, size); }
+static inline void vfree(const void *p) { free((void *)p); }
+
+/*
+ * User memory, the harness passes ordinary pointers
+ */
+static inline unsigned long copy_to_user(void *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+#define get_user(x, ptr) ({ (x) = *(ptr); 0; })
+
+/*
+ * iov_iter over an iovec array, with the kernel's copy semantics
+ */
+#define ITER_SOURCE 0
+#define ITER_DEST 1
+
+struct iov_iter {
+    const struct iovec *iov;
+    unsigned long nr_segs;
+    size_t iov_offset;
+    size_t count;
+};
+
+static inline void iov_iter_init(struct iov_iter *i, unsigned int direction,
+                                 const struct iovec *iov, unsigned long nr_segs, size_t count)
+{
+    i->iov = iov;
+    i->nr_segs = nr_segs;
+    i->iov_offset = 0;
+    i->count = count;
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+    return i->count;
+}
+
+size_t kshim_iter_copy(struct iov_iter *i, void *buf, size_t n, bool to_iter);
+void iov_iter_revert(struct iov_iter *i, size_t n);
+void iov_iter_advance(struct iov_iter *i, size_t n);
+
+static inline size_t copy_to_iter(const void *src, size_t n, struct iov_iter *i)
+{
+    return kshim_iter_copy(i, (void *)src, n, true);
+}
+
+static inline size_t copy_from_iter(void *dst, size_t n, struct iov_iter *i)
+{
+    return kshim_iter_copy(i, dst, n, false);
+}
+
+/*
+ * Locking
+ */
+struct mutex { pthread_mutex_t m; };
+
+static inline void mutex_init(struct mutex *l) { pthread_mutex_init(&l->m, NULL); }
+static inline void mutex_destroy(struct mutex *l) { pthread_mutex_destroy(&l->m); }
+static inline void mutex_lock(struct mutex *l) { pthread_mutex_lock(&l->m); }
+static inline int mutex_lock_interruptible(struct mutex *l) { return pthread_mutex_lock(&l->m); }
+static inline int mutex_trylock(struct mutex *l) { return pthread_mutex_trylock(&l->m) == 0; }
+static inline void mutex_unlock(struct mutex *l) { pthread_mutex_unlock(&l->m); }
+
+typedef struct {
+    unsigned int sequence;
+    struct mutex *lock;
+} seqcount_mutex_t;
+
+static inline void seqcount_mutex_init(seqcount_mutex_t *s, struct mutex *lock)
+{
+    s->sequence = 0;
+    s->lock = lock;
+}
+
+static inline unsigned int read_seqcount_begin(seqcount_mutex_t *s)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return seq;
+}
+
+static inline int read_seqcount_retry(seqcount_mutex_t *s, unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void write_seqcount_begin(seqcount_mutex_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_mutex_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+struct srcu_struct {
+    pthread_rwlock_t readers;
+    pthread_mutex_t pending_lock;
+    pthread_cond_t pending_cond;
+    struct rcu_head *pending;
+    unsigned long queued;              /* Callbacks queued so far */
+    unsigned long completed;           /* Callbacks run so far */
+    bool stop;
+    pthread_t reclaimer;
+};
+
+int init_srcu_struct(struct srcu_struct *ssp);
+void cleanup_srcu_struct(struct srcu_struct *ssp);
+int srcu_read_lock(struct srcu_struct *ssp);
+void srcu_read_unlock(struct srcu_struct *ssp, int idx);
+void call_srcu(struct srcu_struct *ssp, struct rcu_head *head, void (*func)(struct rcu_head *head));
+void srcu_barrier(struct srcu_struct *ssp);
+
+typedef struct {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->m, NULL);
+    pthread_cond_init(&wq->c, NULL);
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->m);
+    pthread_cond_broadcast(&wq->c);
+    pthread_mutex_unlock(&wq->m);
+}
+
+#define wait_event_interruptible(wq, condition) \
+    ({ \
+        pthread_mutex_lock(&(wq).m); \
+        while (!(condition)) \
+            pthread_cond_wait(&(wq).c, &(wq).m); \
+        pthread_mutex_unlock(&(wq).m); \
+        0; \
+    })
+
+/*
+ * Files and char devices
+ */
+#define MINORBITS 20
+#define MKDEV(ma, mi) (((ma) << MINORBITS) | (mi))
+#define MAJOR(dev) ((unsigned int)((dev) >> MINORBITS))
+#define MINOR(dev) ((unsigned int)((dev) & ((1U << MINORBITS) - 1)))
+
+#define IOCB_NOWAIT 1
+
+typedef unsigned int __poll_t;
+typedef struct poll_table_struct { int unused; } poll_table;
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLRDNORM POLLRDNORM
+#define EPOLLWRNORM POLLWRNORM
+
+struct seq_file;
+struct pipe_inode_info;
+struct fasync_struct { int unused; };
+
+#define VM_WRITE 0x2
+#define VM_MAYWRITE 0x20
+struct vm_area_struct {
+    unsigned long vm_flags;
+    unsigned long vm_pgoff;
+};
+
+struct cdev;
+struct inode {
+    struct cdev *i_cdev;
+};
+
+struct file {
+    void *private_data;
+    loff_t f_pos;
+    unsigned int f_flags;
+};
+
+struct kiocb {
+    struct file *ki_filp;
+    loff_t ki_pos;
+    int ki_flags;
+};
+
+struct file_operations {
+    void *owner;
+    ssize_t (*read_iter)(struct kiocb *iocb, struct iov_iter *to);
+    ssize_t (*write_iter)(struct kiocb *iocb, struct iov_iter *from);
+    ssize_t (*splice_read)(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                           size_t len, unsigned int flags);
+    int (*open)(struct inode *inode, struct file *filp);
+    int (*release)(struct inode *inode, struct file *filp);
+    loff_t (*llseek)(struct file *filp, loff_t offset, int whence);
+    long (*unlocked_ioctl)(struct file *filp, unsigned int cmd, unsigned long arg);
+    int (*mmap)(struct file *filp, struct vm_area_struct *vma);
+    __poll_t (*poll)(struct file *filp, poll_table *wait);
+    int (*fasync)(int fd, struct file *filp, int on);
+    /* Not in the kernel: the show function of a DEFINE_SHOW_ATTRIBUTE file */
+    int (*kshim_show)(struct seq_file *s, void *unused);
+};
+
+struct cdev {
+    void *owner;
+    const struct file_operations *ops;
+    dev_t dev;
+};
+
+static inline void cdev_init(struct cdev *cdev, const struct file_operations *fops) { cdev->ops = fops; }
+static inline int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count) { cdev->dev = dev; return 0; }
+static inline void cdev_del(struct cdev *cdev) { }
+
+static inline int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name)
+{
+    *dev = MKDEV(240, baseminor);
+    return 0;
+}
+
+static inline void unregister_chrdev_region(dev_t dev, unsigned int count) { }
+
+loff_t fixed_size_llseek(struct file *filp, loff_t offset, int whence, loff_t size);
+
+static inline ssize_t copy_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                                       size_t len, unsigned int flags)
+{
+    return -EINVAL;
+}
+
+static inline void poll_wait(struct file *filp, wait_queue_head_t *wq, poll_table *p) { }
+static inline int fasync_helper(int fd, struct file *filp, int on, struct fasync_struct **fapp) { return 0; }
+static inline void kill_fasync(struct fasync_struct **fapp, int sig, int band) { }
+
+static inline void vm_flags_clear(struct vm_area_struct *vma, unsigned long flags) { vma->vm_flags &= ~flags; }
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff) { return 0; }
+
+/*
+ * debugfs files are recorded so the harness can print them, see kshim_debugfs_show()
+ */
+struct dentry { char name[64]; };
+
+struct seq_file {
+    void *private;
+    FILE *out;
+};
+
+void seq_printf(struct seq_file *s, const char *fmt, ...);
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, unsigned short mode, struct dentry *parent,
+                                   void *data, const struct file_operations *fops);
+void debugfs_remove_recursive(struct dentry *dentry);
+
+#define DEFINE_SHOW_ATTRIBUTE(name) \
+    static const struct file_operations name##_fops = { \
+        .owner = THIS_MODULE, \
+        .kshim_show = name##_show, \
+    }
+
+/*
+ * Prints every debugfs file created so far to @out
+ */
+void kshim_debugfs_show(FILE *out);
+
+/*
+ * Tracepoints compile to functions that evaluate their fields and do nothing
+ */
+#define TP_PROTO(...) __VA_ARGS__
+#define TP_ARGS(...) __VA_ARGS__
+#define TP_STRUCT__entry(...) __VA_ARGS__
+#define TP_fast_assign(...) __VA_ARGS__
+#define __field(type, name) type name;
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_##name(proto) \
+    { \
+        struct { tstruct } entry, *__entry = &entry; \
+        assign; \
+        (void)__entry; \
+    }
+#define DECLARE_EVENT_CLASS(class, proto, args, tstruct, assign, print) \
+    static inline void trace_##class(proto) \
+    { \
+        struct { tstruct } entry, *__entry = &entry; \
+        assign; \
+        (void)__entry; \
+    }
+#define DEFINE_EVENT(class, name, proto, args) \
+    static inline void trace_##name(proto) \
+    { \
+        trace_##class(args); \
+    }
+
+#endif /* KSHIM_H */
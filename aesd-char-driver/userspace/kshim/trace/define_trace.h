@@ -0,0 +1 @@
+/* Tracepoints are expanded by linux/tracepoint.h in the shim, nothing to define */
@@ -0,0 +1,269 @@
+/**
+ * @file lockfree-ring-stress.c
+ * @brief Stress test and benchmark of aesd-lockfree-ring.c
+ *
+ * Producer threads append entries that encode their producer, a per-producer
+ * count and a byte pattern derived from both.  Reader threads repeatedly
+ * replay the whole history, the way aesdsocket sends it back to a client,
+ * and check every entry they get is intact and that each producer's entries
+ * come back in the order they were appended.
+ *
+ * With -m the same workload runs on a struct aesd_circular_buffer behind a
+ * pthread mutex instead, as a baseline.
+ *
+ * Usage: lockfree-ring-stress [-p producers] [-r readers] [-c capacity]
+ *                             [-s entry_size] [-d seconds] [-m]
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd-circular-buffer.h"
+#include "aesd-lockfree-ring.h"
+
+#define STRESS_MAX_PRODUCERS 64
+
+struct stress_entry
+{
+    uint32_t producer;
+    uint32_t size;
+    uint64_t count;
+    unsigned char pattern[];
+};
+
+struct stress_thread
+{
+    pthread_t thread;
+    unsigned int id;
+    bool producer;
+    uint64_t ops;
+    uint64_t lost;
+};
+
+static struct aesd_lockfree_ring ring;
+static struct aesd_circular_buffer locked_ring;
+static char *locked_slots;
+static pthread_mutex_t locked_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool use_mutex;
+static uint32_t capacity = 1024;
+static size_t entry_size = 64;
+static volatile bool stress_stop;
+
+static unsigned char stress_byte(const struct stress_entry *entry, size_t i)
+{
+    return (unsigned char)(entry->producer * 131 + entry->count * 7 + i);
+}
+
+static void stress_fill(struct stress_entry *entry, unsigned int producer, uint64_t count)
+{
+    size_t i;
+
+    entry->producer = producer;
+    entry->size = entry_size;
+    entry->count = count;
+    for (i = 0; i < entry_size - sizeof(*entry); i++) {
+        entry->pattern[i] = stress_byte(entry, i);
+    }
+}
+
+static void stress_check(const struct stress_entry *entry, ssize_t size, uint64_t *last_count)
+{
+    size_t i;
+
+    if (size != (ssize_t)entry_size || entry->size != entry_size || entry->producer >= STRESS_MAX_PRODUCERS) {
+        fprintf(stderr, "torn entry header\n");
+        exit(1);
+    }
+    for (i = 0; i < entry_size - sizeof(*entry); i++) {
+        if (entry->pattern[i] != stress_byte(entry, i)) {
+            fprintf(stderr, "torn entry from producer %u count %" PRIu64 "\n", entry->producer, entry->count);
+            exit(1);
+        }
+    }
+    if (last_count[entry->producer] != UINT64_MAX && entry->count <= last_count[entry->producer]) {
+        fprintf(stderr, "producer %u entries out of order\n", entry->producer);
+        exit(1);
+    }
+    last_count[entry->producer] = entry->count;
+}
+
+/*
+ * Baseline: appends under the mutex, copying into the slot the ring entry will use
+ */
+static void locked_push(const void *data, size_t size)
+{
+    struct aesd_buffer_entry entry;
+
+    pthread_mutex_lock(&locked_mutex);
+    entry.buffptr = locked_slots + locked_ring.in_offs * entry_size;
+    entry.size = size;
+    memcpy((char *)entry.buffptr, data, size);
+    aesd_circular_buffer_add_entry(&locked_ring, &entry);
+    pthread_mutex_unlock(&locked_mutex);
+}
+
+static void *stress_producer(struct stress_thread *t)
+{
+    struct stress_entry *entry = malloc(entry_size);
+    uint64_t count;
+
+    for (count = 0; !stress_stop; count++) {
+        stress_fill(entry, t->id, count);
+        if (use_mutex) {
+            locked_push(entry, entry_size);
+        } else if (aesd_lockfree_ring_push(&ring, entry, entry_size) < 0) {
+            fprintf(stderr, "push failed\n");
+            exit(1);
+        }
+        t->ops++;
+    }
+    free(entry);
+    return NULL;
+}
+
+static void *stress_reader(struct stress_thread *t)
+{
+    struct stress_entry *entry = malloc(entry_size);
+    struct aesd_lockfree_cursor cursor;
+    uint64_t last_count[STRESS_MAX_PRODUCERS];
+    struct aesd_buffer_entry *slot;
+    uint32_t i;
+    ssize_t ret;
+
+    while (!stress_stop) {
+        memset(last_count, 0xff, sizeof(last_count));
+        if (use_mutex) {
+            //Baseline: copy the whole ring under the mutex
+            pthread_mutex_lock(&locked_mutex);
+            for (i = 0; (slot = aesd_circular_buffer_entry_at(&locked_ring, i, NULL)) != NULL; i++) {
+                memcpy(entry, slot->buffptr, slot->size);
+                stress_check(entry, slot->size, last_count);
+                t->ops++;
+            }
+            pthread_mutex_unlock(&locked_mutex);
+            continue;
+        }
+
+        aesd_lockfree_ring_cursor_init(&ring, &cursor);
+        while ((ret = aesd_lockfree_ring_next(&ring, &cursor, entry, entry_size)) >= 0) {
+            stress_check(entry, ret, last_count);
+            t->ops++;
+        }
+        if (ret != -ENODATA && ret != -EAGAIN) {
+            fprintf(stderr, "read failed: %zd\n", ret);
+            exit(1);
+        }
+        t->lost += cursor.lost;
+    }
+    free(entry);
+    return NULL;
+}
+
+static void *stress_thread_main(void *arg)
+{
+    struct stress_thread *t = arg;
+
+    return t->producer ? stress_producer(t) : stress_reader(t);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-p producers] [-r readers] [-c capacity] [-s entry_size] [-d seconds] [-m]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int producers = 4;
+    unsigned int readers = 4;
+    double seconds = 2.0;
+    struct stress_thread *threads;
+    struct timespec start;
+    struct timespec end;
+    uint64_t pushed = 0;
+    uint64_t read = 0;
+    uint64_t lost = 0;
+    double elapsed;
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:r:c:s:d:m")) != -1) {
+        switch (opt) {
+        case 'p':
+            producers = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            readers = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            capacity = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            entry_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            seconds = strtod(optarg, NULL);
+            break;
+        case 'm':
+            use_mutex = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (producers > STRESS_MAX_PRODUCERS || entry_size < sizeof(struct stress_entry)) {
+        usage(argv[0]);
+    }
+
+    if (use_mutex) {
+        locked_slots = malloc((size_t)capacity * entry_size);
+        if (locked_slots == NULL || aesd_circular_buffer_init_capacity(&locked_ring, capacity) != 0) {
+            fprintf(stderr, "aesd_circular_buffer_init_capacity failed\n");
+            return 1;
+        }
+    } else if (aesd_lockfree_ring_init(&ring, capacity, entry_size) != 0) {
+        fprintf(stderr, "aesd_lockfree_ring_init failed, capacity must be a power of two\n");
+        return 1;
+    }
+
+    threads = calloc(producers + readers, sizeof(*threads));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < producers + readers; i++) {
+        threads[i].producer = i < producers;
+        threads[i].id = threads[i].producer ? i : i - producers;
+        pthread_create(&threads[i].thread, NULL, stress_thread_main, &threads[i]);
+    }
+    usleep(seconds * 1e6);
+    stress_stop = true;
+    for (i = 0; i < producers + readers; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (threads[i].producer) {
+            pushed += threads[i].ops;
+        } else {
+            read += threads[i].ops;
+            lost += threads[i].lost;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%s: %u producers %12.0f pushes/s, %u readers %12.0f entries read/s, %" PRIu64 " lost\n",
+           use_mutex ? "mutex" : "lockfree", producers, pushed / elapsed, readers, read / elapsed, lost);
+
+    if (use_mutex) {
+        aesd_circular_buffer_free(&locked_ring);
+        free(locked_slots);
+    } else {
+        aesd_lockfree_ring_free(&ring);
+    }
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/* Tests for exec-batch.c.
+ * For educational use only.
+ *
+ * Checks output capture, redirection, exit status, spawn failures, the
+ * max_running bound and that an epoll failure still completes every command.
+ * epoll_wait is wrapped at link time (-Wl,--wrap=epoll_wait) so the last test
+ * can make it fail.
+ *
+ * Usage: exec-batch-test
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include "exec-batch.h"
+
+#define BOUND_COMMANDS 8
+#define BOUND_RUNNING 3
+
+static unsigned int failures;
+static bool fail_epoll_wait;
+
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    if (fail_epoll_wait) {
+        errno = EBADF;
+        return -1;
+    }
+    return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static void test_capture(void)
+{
+    char *const echo[] = { "/bin/echo", "hello", "world", NULL };
+    char *const both[] = { "/bin/sh", "-c", "echo out; echo err >&2; exit 3", NULL };
+    char *const large[] = { "/bin/sh", "-c", "head -c 300000 /dev/zero; head -c 200000 /dev/zero >&2", NULL };
+    char *const redirect[] = { "/bin/echo", "to file", NULL };
+    struct exec_cmd cmds[] = {
+        { .argv = echo },
+        { .argv = both },
+        { .argv = large },
+        { .argv = redirect, .outputfile = "/tmp/exec-batch-test.txt" },
+    };
+    char line[32] = "";
+    FILE *fp;
+
+    check(exec_batch(cmds, 4, 0) == 1, "capture: one failure expected");
+    check(cmds[0].success && !strcmp(cmds[0].out, "hello world\n") && cmds[0].err_len == 0,
+          "capture: stdout of echo");
+    check(!cmds[1].success && WIFEXITED(cmds[1].status) && WEXITSTATUS(cmds[1].status) == 3,
+          "capture: exit status 3");
+    check(!strcmp(cmds[1].out, "out\n") && !strcmp(cmds[1].err, "err\n"), "capture: stdout and stderr apart");
+    check(cmds[2].success && cmds[2].out_len == 300000 && cmds[2].err_len == 200000,
+          "capture: output larger than a pipe");
+    check(cmds[3].success && cmds[3].out == NULL, "redirect: nothing captured");
+    fp = fopen("/tmp/exec-batch-test.txt", "r");
+    check(fp != NULL && fgets(line, sizeof(line), fp) != NULL && !strcmp(line, "to file\n"),
+          "redirect: file contents");
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    remove("/tmp/exec-batch-test.txt");
+    exec_batch_free(cmds, 4);
+}
+
+static void test_spawn_failure(void)
+{
+    char *const missing[] = { "/nonexistent/command", NULL };
+    char *const ok[] = { "/bin/echo", NULL };
+    struct exec_cmd cmds[] = {
+        { .argv = missing },
+        { .argv = ok },
+    };
+
+    check(exec_batch(cmds, 2, 1) == 1, "spawn failure: one failure expected");
+    check(!cmds[0].success && cmds[0].status == -1 && cmds[0].spawn_error == ENOENT,
+          "spawn failure: status and spawn_error");
+    check(cmds[0].out != NULL && cmds[0].err != NULL, "spawn failure: empty output strings");
+    check(cmds[1].success, "spawn failure: next command still runs");
+    exec_batch_free(cmds, 2);
+}
+
+/* Every command prints when it started and ended.  No more than BOUND_RUNNING intervals may overlap.
+ */
+static void test_bound(void)
+{
+    char *const timed[] = { "/bin/sh", "-c", "date +%s%N; sleep 0.1; date +%s%N", NULL };
+    struct exec_cmd cmds[BOUND_COMMANDS];
+    unsigned long long start[BOUND_COMMANDS];
+    unsigned long long end[BOUND_COMMANDS];
+    unsigned int overlapping;
+    unsigned int max_overlapping = 0;
+    unsigned int i;
+    unsigned int j;
+
+    memset(cmds, 0, sizeof(cmds));
+    for (i = 0; i < BOUND_COMMANDS; i++) {
+        cmds[i].argv = timed;
+    }
+    check(exec_batch(cmds, BOUND_COMMANDS, BOUND_RUNNING) == 0, "bound: all succeed");
+    for (i = 0; i < BOUND_COMMANDS; i++) {
+        if (cmds[i].out == NULL || sscanf(cmds[i].out, "%llu %llu", &start[i], &end[i]) != 2) {
+            check(false, "bound: timestamps");
+            exec_batch_free(cmds, BOUND_COMMANDS);
+            return;
+        }
+    }
+    for (i = 0; i < BOUND_COMMANDS; i++) {
+        overlapping = 0;
+        for (j = 0; j < BOUND_COMMANDS; j++) {
+            overlapping += start[j] <= start[i] && end[j] > start[i];
+        }
+        if (overlapping > max_overlapping) {
+            max_overlapping = overlapping;
+        }
+    }
+    check(max_overlapping <= BOUND_RUNNING, "bound: more commands running than max_running");
+    exec_batch_free(cmds, BOUND_COMMANDS);
+}
+
+static void test_epoll_failure(void)
+{
+    char *const slow[] = { "/bin/sh", "-c", "sleep 0.1; echo late", NULL };
+    struct exec_cmd cmds[4];
+    unsigned int i;
+
+    memset(cmds, 0, sizeof(cmds));
+    for (i = 0; i < 4; i++) {
+        cmds[i].argv = slow;
+    }
+    fail_epoll_wait = true;
+    check(exec_batch(cmds, 4, 1) == 4, "epoll failure: every command counted as failed");
+    fail_epoll_wait = false;
+    check(cmds[0].status != -1 && cmds[0].spawn_error == 0, "epoll failure: started command reaped");
+    for (i = 1; i < 4; i++) {
+        check(!cmds[i].success && cmds[i].status == -1 && cmds[i].spawn_error == EBADF,
+              "epoll failure: unstarted command marked failed");
+        check(cmds[i].out != NULL && cmds[i].err != NULL, "epoll failure: empty output strings");
+    }
+    exec_batch_free(cmds, 4);
+}
+
+int main(void)
+{
+    test_capture();
+    test_spawn_failure();
+    test_bound();
+    test_epoll_failure();
+    printf("%u failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,339 @@
+/* Parallel command execution, see exec-batch.h.
+ *
+ * Commands are started with posix_spawn(), which glibc implements with
+ * clone(CLONE_VM | CLONE_VFORK): the parent's address space isn't copied the
+ * way fork() in do_exec() copies it, which matters for a large parent
+ * starting hundreds of commands.
+ *
+ * Each running command has up to three descriptors in one epoll instance:
+ * the read ends of its stdout and stderr pipes, and a pidfd that becomes
+ * readable when it exits.  A command is finished once both pipes reached
+ * end of file and it has been reaped, then the next one is started.
+ *
+ * For educational use only.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "exec-batch.h"
+
+extern char **environ;
+
+#define READ_CHUNK 4096
+#define MAX_EVENTS 64
+
+enum stream {
+    STREAM_OUT,
+    STREAM_ERR,
+    STREAM_PID, // pidfd, readable once the command exits
+    STREAMS
+};
+
+struct exec_state {
+    pid_t pid; // 0 once reaped
+    int fds[STREAMS]; // -1 once closed or not used
+    size_t cap[STREAM_PID]; // Allocated size of out and err
+};
+
+static int pidfd_open_compat(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Reads everything available on a pipe into the matching buffer of @param cmd.
+ * @return false once the pipe reached end of file
+ */
+static bool drain(struct exec_cmd *cmd, struct exec_state *st, enum stream stream)
+{
+    char **buf = stream == STREAM_OUT ? &cmd->out : &cmd->err;
+    size_t *len = stream == STREAM_OUT ? &cmd->out_len : &cmd->err_len;
+    ssize_t n;
+
+    for (;;) {
+        if (st->cap[stream] - *len < READ_CHUNK + 1) {
+            size_t cap = st->cap[stream] ? st->cap[stream] * 2 : READ_CHUNK * 2;
+            char *grown = realloc(*buf, cap);
+
+            if (grown == NULL) {
+                perror("Output buffer allocation failed.");
+                return false;
+            }
+            *buf = grown;
+            st->cap[stream] = cap;
+        }
+        n = read(st->fds[stream], *buf + *len, st->cap[stream] - *len - 1);
+        if (n > 0) {
+            *len += n;
+            (*buf)[*len] = '\0';
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return n < 0 && errno == EAGAIN;
+        }
+    }
+}
+
+static void close_stream(int epfd, struct exec_state *st, enum stream stream)
+{
+    if (st->fds[stream] >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, st->fds[stream], NULL);
+        close(st->fds[stream]);
+        st->fds[stream] = -1;
+    }
+}
+
+static void reap(struct exec_cmd *cmd, struct exec_state *st)
+{
+    while (waitpid(st->pid, &cmd->status, 0) < 0 && errno == EINTR) {
+    }
+    st->pid = 0;
+}
+
+static bool watch(int epfd, int fd, size_t index, enum stream stream)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)index * STREAMS + stream;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+/* Starts cmds[index] and adds its descriptors to @param epfd.
+ * @return false if it could not be started, with spawn_error set
+ */
+static bool start(struct exec_cmd *cmds, struct exec_state *states, size_t index, int epfd)
+{
+    struct exec_cmd *cmd = &cmds[index];
+    struct exec_state *st = &states[index];
+    posix_spawn_file_actions_t actions;
+    int out[2] = {-1, -1};
+    int err[2] = {-1, -1};
+    int rc;
+    int i;
+
+    // Close on exec keeps every other command's pipes out of this child, dup2 clears it on 1 and 2
+    if ((cmd->outputfile == NULL && pipe2(out, O_CLOEXEC) != 0) || pipe2(err, O_CLOEXEC) != 0) {
+        cmd->spawn_error = errno;
+        perror("pipe2 failed.");
+        close(out[0]);
+        close(out[1]);
+        return false;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    if (cmd->outputfile != NULL) {
+        // The child writes to the file itself, the output never passes through this process
+        posix_spawn_file_actions_addopen(&actions, 1, cmd->outputfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else {
+        posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+    }
+    posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+    rc = posix_spawn(&st->pid, cmd->argv[0], &actions, NULL, cmd->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (out[1] >= 0) {
+        close(out[1]);
+    }
+    close(err[1]);
+
+    if (rc != 0) {
+        cmd->spawn_error = rc;
+        st->pid = 0;
+        if (out[0] >= 0) {
+            close(out[0]);
+        }
+        close(err[0]);
+        return false;
+    }
+
+    st->fds[STREAM_OUT] = out[0];
+    st->fds[STREAM_ERR] = err[0];
+    st->fds[STREAM_PID] = pidfd_open_compat(st->pid);
+    for (i = 0; i < STREAMS; i++) {
+        if (st->fds[i] < 0) {
+            continue;
+        }
+        fcntl(st->fds[i], F_SETFL, fcntl(st->fds[i], F_GETFL) | O_NONBLOCK);
+        if (!watch(epfd, st->fds[i], index, i)) {
+            // Can't happen for a fresh descriptor short of running out of memory, read it blocking instead
+            perror("epoll_ctl failed.");
+            if (i != STREAM_PID) {
+                fcntl(st->fds[i], F_SETFL, fcntl(st->fds[i], F_GETFL) & ~O_NONBLOCK);
+                while (drain(cmd, st, i)) {
+                }
+            }
+            close(st->fds[i]);
+            st->fds[i] = -1;
+        }
+    }
+    return true;
+}
+
+/* @return true once both pipes of @param st are closed and it was reaped, reaping it
+ * first if there is no pidfd to wait on
+ */
+static bool finished(struct exec_cmd *cmd, struct exec_state *st)
+{
+    if (st->fds[STREAM_OUT] >= 0 || st->fds[STREAM_ERR] >= 0) {
+        return false;
+    }
+    if (st->pid != 0 && st->fds[STREAM_PID] < 0) {
+        // No pidfd, the command closed its output so it is most likely exiting
+        reap(cmd, st);
+    }
+    return st->pid == 0;
+}
+
+/* Sets the outcome of a finished command and makes sure its captured output is a string
+ */
+static bool complete(struct exec_cmd *cmd)
+{
+    if (cmd->outputfile == NULL && cmd->out == NULL) {
+        cmd->out = calloc(1, 1);
+    }
+    if (cmd->err == NULL) {
+        cmd->err = calloc(1, 1);
+    }
+    cmd->success = cmd->status != -1 && WIFEXITED(cmd->status) && WEXITSTATUS(cmd->status) == 0;
+    return cmd->success;
+}
+
+int exec_batch(struct exec_cmd *cmds, size_t count, unsigned int max_running)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct exec_state *states;
+    size_t next = 0;
+    size_t running = 0;
+    int failed = 0;
+    int epoll_error = 0;
+    int epfd;
+    int n;
+    int i;
+
+    states = calloc(count ? count : 1, sizeof(*states));
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (states == NULL || epfd < 0) {
+        perror("exec_batch setup failed.");
+        free(states);
+        if (epfd >= 0) {
+            close(epfd);
+        }
+        return -1;
+    }
+    for (next = 0; next < count; next++) {
+        cmds[next].out = NULL;
+        cmds[next].out_len = 0;
+        cmds[next].err = NULL;
+        cmds[next].err_len = 0;
+        cmds[next].status = -1;
+        cmds[next].spawn_error = 0;
+        cmds[next].success = false;
+        for (i = 0; i < STREAMS; i++) {
+            states[next].fds[i] = -1;
+        }
+    }
+    next = 0;
+    if (max_running == 0 || max_running > count) {
+        max_running = count;
+    }
+
+    while (next < count || running > 0) {
+        while (next < count && running < max_running) {
+            if (start(cmds, states, next, epfd)) {
+                running++;
+                if (finished(&cmds[next], &states[next])) {
+                    running--;
+                    failed += !complete(&cmds[next]);
+                }
+            } else {
+                failed += !complete(&cmds[next]);
+            }
+            next++;
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            epoll_error = errno;
+            perror("epoll_wait failed.");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            size_t index = events[i].data.u64 / STREAMS;
+            enum stream stream = events[i].data.u64 % STREAMS;
+            struct exec_state *st = &states[index];
+
+            if (st->fds[stream] < 0) {
+                continue;
+            }
+            if (stream == STREAM_PID) {
+                reap(&cmds[index], st);
+                close_stream(epfd, st, STREAM_PID);
+            } else if (!drain(&cmds[index], st, stream)) {
+                close_stream(epfd, st, stream);
+            }
+            if (finished(&cmds[index], st)) {
+                running--;
+                failed += !complete(&cmds[index]);
+            }
+        }
+    }
+
+    // Only left unstarted or running if epoll failed.  Unstarted ones fail with its error,
+    // running ones are waited for without capturing more output.
+    for (; next < count; next++) {
+        cmds[next].spawn_error = epoll_error;
+        failed += !complete(&cmds[next]);
+    }
+    for (next = 0; next < count; next++) {
+        struct exec_state *st = &states[next];
+
+        if (st->pid == 0 && st->fds[STREAM_OUT] < 0 && st->fds[STREAM_ERR] < 0 && st->fds[STREAM_PID] < 0) {
+            continue;
+        }
+        for (i = 0; i < STREAMS; i++) {
+            close_stream(epfd, st, i);
+        }
+        if (st->pid != 0) {
+            reap(&cmds[next], st);
+        }
+        failed += !complete(&cmds[next]);
+    }
+
+    close(epfd);
+    free(states);
+    return failed;
+}
+
+void exec_batch_free(struct exec_cmd *cmds, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        free(cmds[i].out);
+        free(cmds[i].err);
+        cmds[i].out = NULL;
+        cmds[i].err = NULL;
+    }
+}
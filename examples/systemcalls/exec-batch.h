@@ -0,0 +1,45 @@
+/* Runs a batch of commands in parallel, for scripts that would otherwise call
+ * do_exec() or do_exec_redirect() hundreds of times in a row.
+ *
+ * For educational use only.
+ */
+
+#ifndef EXEC_BATCH_H
+#define EXEC_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * One command of a batch.  The caller fills in argv and outputfile, exec_batch()
+ * fills in the rest.
+ */
+struct exec_cmd {
+    char *const *argv; // NULL terminated, argv[0] is the full path to the command as for do_exec()
+    const char *outputfile; // If set, stdout is written to this file as by do_exec_redirect()
+
+    char *out; // Captured stdout, NUL terminated, NULL when outputfile is set
+    size_t out_len;
+    char *err; // Captured stderr, NUL terminated
+    size_t err_len;
+    int status; // waitpid() status, -1 if the command could not be started
+    int spawn_error; // errno from starting the command, or from the batch failing before it could, 0 if it started
+    bool success; // The command exited with status 0
+};
+
+/**
+* Starts the @param count commands in @param cmds with posix_spawn(), keeping at most
+* @param max_running of them running at once, 0 for no limit.  Their stdin is /dev/null.
+* stdout and stderr are collected through pipes, all watched by one epoll instance, so a
+* command filling its pipe never stalls the others.
+* Returns when every command has exited.
+* @return the number of commands that did not succeed, or -1 if the batch could not be run
+*/
+int exec_batch(struct exec_cmd *cmds, size_t count, unsigned int max_running);
+
+/**
+* Frees the output buffers exec_batch() allocated in @param cmds.
+*/
+void exec_batch_free(struct exec_cmd *cmds, size_t count);
+
+#endif /* EXEC_BATCH_H */
@@ -0,0 +1,61 @@
+/* Scheduler version of start_thread_obtaining_mutex, see mutex-task.h.
+ * For educational use only.
+ */
+
+#include "mutex-task.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("mutex-task: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("mutex-task ERROR: " msg "\n" , ##__VA_ARGS__)
+
+/* Obtains, waits, and releases the mutex once the obtain delay has passed on the scheduler timer.
+ * @param task task member of a struct mutex_task
+ * @return false if obtaining or releasing the mutex failed
+ */
+static bool taskfunc(struct task *task)
+{
+    struct mutex_task *mt = task->arg;
+    int rc;
+
+    rc = pthread_mutex_lock(mt->mutex);
+    if (rc != 0) {
+        ERROR_LOG("pthread_mutex_lock failed with %d", rc);
+        return false;
+    }
+
+    usleep(mt->wait_to_release_ms * 1000);
+
+    rc = pthread_mutex_unlock(mt->mutex);
+    if (rc != 0) {
+        ERROR_LOG("pthread_mutex_unlock failed with %d", rc);
+        return false;
+    }
+    return true;
+}
+
+struct mutex_task *start_task_obtaining_mutex(struct scheduler *sched, pthread_mutex_t *mutex,
+                                              int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    struct mutex_task *mt = calloc(1, sizeof(*mt));
+
+    if (mt == NULL) {
+        ERROR_LOG("Malloc failed to allocate.");
+        return NULL;
+    }
+
+    mt->mutex = mutex;
+    mt->wait_to_release_ms = wait_to_release_ms;
+    mt->task.fn = taskfunc;
+    mt->task.arg = mt;
+
+    if (!scheduler_submit_after(sched, &mt->task, wait_to_obtain_ms > 0 ? wait_to_obtain_ms : 0)) {
+        ERROR_LOG("scheduler_submit_after failed");
+        free(mt);
+        return NULL;
+    }
+    return mt;
+}
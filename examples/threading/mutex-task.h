@@ -0,0 +1,34 @@
+/* Scheduler version of start_thread_obtaining_mutex from threading.h, kept
+ * apart so threading.c still builds on its own.
+ * For educational use only.
+ */
+
+#ifndef MUTEX_TASK_H
+#define MUTEX_TASK_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "scheduler.h"
+
+/**
+ * Like struct thread_data, dynamically allocated by start_task_obtaining_mutex and freed by
+ * the caller once the task is complete.  The outcome is task.task_complete_success.
+ */
+struct mutex_task {
+    struct task task;
+    pthread_mutex_t *mutex; // Mutex for the task to obtain
+    int wait_to_release_ms; // Time to wait to release the mutex in ms
+};
+
+/**
+* Like start_thread_obtaining_mutex, but runs on the workers of @param sched instead of a thread of its own.
+* No thread sleeps during @param wait_to_obtain_ms, the task is queued on the scheduler's timer.
+* The worker does sleep while holding the mutex, a pthread mutex must be released by the thread that
+* obtained it.
+* Wait for the returned mutex_task with scheduler_wait(sched, &mt->task), then free it.
+* @return the mutex_task, or NULL if it could not be submitted
+*/
+struct mutex_task *start_task_obtaining_mutex(struct scheduler *sched, pthread_mutex_t *mutex,
+                                              int wait_to_obtain_ms, int wait_to_release_ms);
+
+#endif /* MUTEX_TASK_H */
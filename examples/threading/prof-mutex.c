@@ -0,0 +1,189 @@
+/* Profiling mutex, see prof-mutex.h.
+ * For educational use only.
+ */
+
+#include "prof-mutex.h"
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Spin limit is twice the recent estimate plus this, capped at PROF_MUTEX_MAX_SPINS like glibc's adaptive mutex
+#define PROF_MUTEX_MIN_SPINS 10
+#define PROF_MUTEX_MAX_SPINS 200
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned int bucket(uint64_t ns)
+{
+    unsigned int i = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+
+    return i < PROF_MUTEX_BUCKETS ? i : PROF_MUTEX_BUCKETS - 1;
+}
+
+int prof_mutex_init(struct prof_mutex *pm, const char *name, enum prof_mutex_mode mode)
+{
+    memset(pm, 0, sizeof(*pm));
+    pm->name = name;
+    pm->mode = mode;
+    if (mode == PROF_MUTEX_SPIN_PARK && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        pm->mode = PROF_MUTEX_PARK;
+    }
+    return pthread_mutex_init(&pm->mutex, NULL);
+}
+
+int prof_mutex_destroy(struct prof_mutex *pm)
+{
+    return pthread_mutex_destroy(&pm->mutex);
+}
+
+/* Spins on trylock for up to a limit derived from how many spins earlier acquisitions needed.
+ * @return true if the lock was taken
+ */
+static bool spin_lock(struct prof_mutex *pm)
+{
+    // Read racily, the estimate is only a hint
+    unsigned int estimate = __atomic_load_n(&pm->spin_estimate, __ATOMIC_RELAXED);
+    unsigned int limit = estimate * 2 + PROF_MUTEX_MIN_SPINS;
+    unsigned int spins;
+
+    if (limit > PROF_MUTEX_MAX_SPINS) {
+        limit = PROF_MUTEX_MAX_SPINS;
+    }
+    for (spins = 1; spins <= limit; spins++) {
+        cpu_relax();
+        if (pthread_mutex_trylock(&pm->mutex) == 0) {
+            // Move the estimate an eighth of the way towards this acquisition
+            __atomic_store_n(&pm->spin_estimate, estimate + ((int)spins - (int)estimate) / 8, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    // Spinning didn't pay off, spin less next time
+    __atomic_store_n(&pm->spin_estimate, estimate - estimate / 8, __ATOMIC_RELAXED);
+    return false;
+}
+
+int prof_mutex_lock(struct prof_mutex *pm)
+{
+    uint64_t start;
+    uint64_t wait;
+    bool spun = false;
+    int rc;
+
+    if (pthread_mutex_trylock(&pm->mutex) == 0) {
+        pm->locked_ns = now_ns();
+        pm->stats.acquisitions++;
+        return 0;
+    }
+
+    start = now_ns();
+    if (pm->mode == PROF_MUTEX_SPIN_PARK) {
+        spun = spin_lock(pm);
+    }
+    if (!spun) {
+        rc = pthread_mutex_lock(&pm->mutex);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    pm->locked_ns = now_ns();
+    wait = pm->locked_ns - start;
+
+    pm->stats.acquisitions++;
+    pm->stats.contended++;
+    pm->stats.spun += spun;
+    pm->stats.wait_total_ns += wait;
+    if (wait > pm->stats.wait_max_ns) {
+        pm->stats.wait_max_ns = wait;
+    }
+    pm->stats.wait_hist[bucket(wait)]++;
+    return 0;
+}
+
+int prof_mutex_unlock(struct prof_mutex *pm)
+{
+    uint64_t hold = now_ns() - pm->locked_ns;
+
+    pm->stats.hold_total_ns += hold;
+    if (hold > pm->stats.hold_max_ns) {
+        pm->stats.hold_max_ns = hold;
+    }
+    pm->stats.hold_hist[bucket(hold)]++;
+    return pthread_mutex_unlock(&pm->mutex);
+}
+
+void prof_mutex_snapshot(struct prof_mutex *pm, struct prof_mutex_stats *stats, bool reset)
+{
+    // Plain lock, a snapshot shouldn't show up in the statistics it takes
+    pthread_mutex_lock(&pm->mutex);
+    *stats = pm->stats;
+    if (reset) {
+        memset(&pm->stats, 0, sizeof(pm->stats));
+    }
+    pthread_mutex_unlock(&pm->mutex);
+}
+
+uint64_t prof_mutex_percentile_ns(const uint64_t hist[PROF_MUTEX_BUCKETS], double percentile)
+{
+    uint64_t total = 0;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < PROF_MUTEX_BUCKETS; i++) {
+        total += hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (i = 0; i < PROF_MUTEX_BUCKETS - 1; i++) {
+        seen += hist[i];
+        if (seen >= total * percentile / 100.0) {
+            break;
+        }
+    }
+    return (2ull << i) - 1;
+}
+
+static void dump_hist(FILE *out, const char *what, const uint64_t hist[PROF_MUTEX_BUCKETS])
+{
+    unsigned int i;
+
+    for (i = 0; i < PROF_MUTEX_BUCKETS; i++) {
+        if (hist[i] != 0) {
+            fprintf(out, "  %s %12" PRIu64 " ns%s: %" PRIu64 "\n", what, (uint64_t)1 << i,
+                    i == PROF_MUTEX_BUCKETS - 1 ? "+" : " ", hist[i]);
+        }
+    }
+}
+
+void prof_mutex_dump(struct prof_mutex *pm, FILE *out)
+{
+    struct prof_mutex_stats s;
+
+    prof_mutex_snapshot(pm, &s, false);
+    fprintf(out, "%s: %" PRIu64 " acquisitions, %" PRIu64 " contended (%.1f%%), %" PRIu64 " got by spinning\n",
+            pm->name, s.acquisitions, s.contended,
+            s.acquisitions ? 100.0 * s.contended / s.acquisitions : 0.0, s.spun);
+    fprintf(out, "  wait: avg %" PRIu64 " ns when contended, p50 < %" PRIu64 ", p99 < %" PRIu64 ", max %" PRIu64 "\n",
+            s.contended ? s.wait_total_ns / s.contended : 0, prof_mutex_percentile_ns(s.wait_hist, 50),
+            prof_mutex_percentile_ns(s.wait_hist, 99), s.wait_max_ns);
+    fprintf(out, "  hold: avg %" PRIu64 " ns, p50 < %" PRIu64 ", p99 < %" PRIu64 ", max %" PRIu64 "\n",
+            s.acquisitions ? s.hold_total_ns / s.acquisitions : 0, prof_mutex_percentile_ns(s.hold_hist, 50),
+            prof_mutex_percentile_ns(s.hold_hist, 99), s.hold_max_ns);
+    dump_hist(out, "wait", s.wait_hist);
+    dump_hist(out, "hold", s.hold_hist);
+}
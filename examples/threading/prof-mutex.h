@@ -0,0 +1,85 @@
+/* Profiling mutex: a pthread mutex that also records how long threads wait
+ * for it and how long they hold it.
+ * For educational use only.
+ *
+ * prof_mutex_lock()/prof_mutex_unlock() replace pthread_mutex_lock()/
+ * pthread_mutex_unlock().  Statistics are only updated by the thread holding
+ * the lock, so recording them takes no atomic operations, just a clock read
+ * on lock and on unlock.  Wait and hold times go into histograms with one
+ * bucket per power of two nanoseconds.
+ */
+
+#ifndef PROF_MUTEX_H
+#define PROF_MUTEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define PROF_MUTEX_BUCKETS 32 // Bucket i counts times in [2^i, 2^(i+1)) ns, the last one everything longer
+
+enum prof_mutex_mode {
+    PROF_MUTEX_PARK, // Sleep in the kernel as soon as the lock is taken, like pthread_mutex_lock
+    PROF_MUTEX_SPIN_PARK, // Spin briefly first, for locks held for less than a context switch
+};
+
+struct prof_mutex_stats {
+    uint64_t acquisitions;
+    uint64_t contended; // Acquisitions that found the lock held
+    uint64_t spun; // Contended acquisitions that got the lock while spinning, without parking
+    uint64_t wait_total_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_total_ns;
+    uint64_t hold_max_ns;
+    uint64_t wait_hist[PROF_MUTEX_BUCKETS]; // Contended acquisitions only
+    uint64_t hold_hist[PROF_MUTEX_BUCKETS];
+};
+
+struct prof_mutex {
+    pthread_mutex_t mutex;
+    const char *name; // For prof_mutex_dump
+    enum prof_mutex_mode mode;
+    unsigned int spin_estimate; // Spins that recent contended acquisitions needed, adapts the spin limit
+    uint64_t locked_ns; // When the current holder got the lock
+    struct prof_mutex_stats stats; // Protected by mutex
+};
+
+/**
+* Initializes @param pm, named @param name in dumps.  PROF_MUTEX_SPIN_PARK falls back to
+* PROF_MUTEX_PARK on a single CPU, where the holder can't run while we spin.
+* @return 0 or the error from pthread_mutex_init
+*/
+int prof_mutex_init(struct prof_mutex *pm, const char *name, enum prof_mutex_mode mode);
+
+int prof_mutex_destroy(struct prof_mutex *pm);
+
+/**
+* Locks @param pm, recording whether and how long the caller waited.
+* @return 0 or the error from pthread_mutex_lock
+*/
+int prof_mutex_lock(struct prof_mutex *pm);
+
+/**
+* Records how long the lock was held and unlocks @param pm.
+* @return 0 or the error from pthread_mutex_unlock
+*/
+int prof_mutex_unlock(struct prof_mutex *pm);
+
+/**
+* Copies the statistics of @param pm to @param stats, then clears them if @param reset.
+*/
+void prof_mutex_snapshot(struct prof_mutex *pm, struct prof_mutex_stats *stats, bool reset);
+
+/**
+* Estimates the @param percentile (0 to 100) of a histogram from its buckets.  Returns the
+* upper bound of the bucket the percentile falls in, 0 if the histogram is empty.
+*/
+uint64_t prof_mutex_percentile_ns(const uint64_t hist[PROF_MUTEX_BUCKETS], double percentile);
+
+/**
+* Writes a summary and the non-empty histogram buckets of @param pm to @param out.
+*/
+void prof_mutex_dump(struct prof_mutex *pm, FILE *out);
+
+#endif /* PROF_MUTEX_H */
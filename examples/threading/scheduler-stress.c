@@ -0,0 +1,195 @@
+/* Stress test for scheduler.c and mutex-task.c.
+ * For educational use only.
+ *
+ * Each round creates a scheduler and checks that:
+ * - a tree of tasks submitting their children from the workers runs every task exactly once,
+ *   which exercises the per-worker queues and stealing,
+ * - tasks submitted from outside the workers all run,
+ * - delayed tasks never run before their delay has passed,
+ * - cancelled delayed tasks complete without success and never run,
+ * - periodic tasks keep running until cancelled, and not after,
+ * - mutex tasks all obtain and release their mutex,
+ * - destroying the scheduler completes tasks still waiting for their delay.
+ *
+ * Usage: scheduler-stress [rounds] [workers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include "scheduler.h"
+#include "mutex-task.h"
+
+#define TREE_TASKS 4095
+#define EXTERNAL_TASKS 2000
+#define DELAYED_TASKS 200
+#define CANCELLED_TASKS 50
+#define MUTEX_TASKS 20
+
+struct test_task {
+    struct task task;
+    struct scheduler *sched;
+    unsigned int index;
+    unsigned int runs; // Updated atomically
+    uint64_t due_ns; // Earliest time a delayed task may run
+    uint64_t ran_ns;
+};
+
+static struct test_task tree[TREE_TASKS];
+static struct test_task external[EXTERNAL_TASKS];
+static struct test_task delayed[DELAYED_TASKS];
+static struct test_task cancelled[CANCELLED_TASKS];
+static unsigned int failures;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void check(bool ok, const char *what, unsigned int round)
+{
+    if (!ok) {
+        printf("round %u: %s\n", round, what);
+        failures++;
+    }
+}
+
+static bool count_run(struct task *task)
+{
+    struct test_task *t = task->arg;
+
+    t->ran_ns = now_ns();
+    __atomic_fetch_add(&t->runs, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/* Submits the two children of this task in the tree from the worker running it
+ */
+static bool tree_run(struct task *task)
+{
+    struct test_task *t = task->arg;
+    unsigned int child;
+    bool success = true;
+
+    count_run(task);
+    for (child = 2 * t->index + 1; child <= 2 * t->index + 2 && child < TREE_TASKS; child++) {
+        success &= scheduler_submit(t->sched, &tree[child].task);
+    }
+    return success;
+}
+
+static void test_task_init(struct test_task *t, struct scheduler *sched, unsigned int index,
+                           bool (*fn)(struct task *task))
+{
+    t->task.fn = fn;
+    t->task.arg = t;
+    t->sched = sched;
+    t->index = index;
+    t->runs = 0;
+}
+
+static void run_round(unsigned int round, unsigned int nr_workers)
+{
+    struct scheduler *sched = scheduler_create(nr_workers);
+    struct mutex_task *mutex_tasks[MUTEX_TASKS];
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct test_task periodic;
+    struct test_task pending;
+    unsigned int seed = round + 1;
+    unsigned int delay_ms;
+    unsigned int runs;
+    unsigned int i;
+
+    if (sched == NULL) {
+        check(false, "scheduler_create failed", round);
+        return;
+    }
+
+    for (i = 0; i < TREE_TASKS; i++) {
+        test_task_init(&tree[i], sched, i, tree_run);
+    }
+    for (i = 0; i < EXTERNAL_TASKS; i++) {
+        test_task_init(&external[i], sched, i, count_run);
+    }
+    for (i = 0; i < CANCELLED_TASKS; i++) {
+        test_task_init(&cancelled[i], sched, i, count_run);
+        check(scheduler_submit_after(sched, &cancelled[i].task, 10000), "cancelled submit failed", round);
+    }
+    for (i = 0; i < DELAYED_TASKS; i++) {
+        test_task_init(&delayed[i], sched, i, count_run);
+        delay_ms = rand_r(&seed) % 20;
+        delayed[i].due_ns = now_ns() + delay_ms * 1000000ull;
+        check(scheduler_submit_after(sched, &delayed[i].task, delay_ms), "delayed submit failed", round);
+    }
+    test_task_init(&periodic, sched, 0, count_run);
+    check(scheduler_submit_every(sched, &periodic.task, 1), "periodic submit failed", round);
+    for (i = 0; i < MUTEX_TASKS; i++) {
+        mutex_tasks[i] = start_task_obtaining_mutex(sched, &mutex, rand_r(&seed) % 5, 1);
+        check(mutex_tasks[i] != NULL, "start_task_obtaining_mutex failed", round);
+    }
+
+    check(scheduler_submit(sched, &tree[0].task), "tree submit failed", round);
+    for (i = 0; i < EXTERNAL_TASKS; i++) {
+        check(scheduler_submit(sched, &external[i].task), "external submit failed", round);
+    }
+    for (i = 0; i < CANCELLED_TASKS; i++) {
+        scheduler_cancel(sched, &cancelled[i].task);
+    }
+
+    for (i = 0; i < MUTEX_TASKS; i++) {
+        if (mutex_tasks[i] != NULL) {
+            check(scheduler_wait(sched, &mutex_tasks[i]->task), "mutex task failed", round);
+            free(mutex_tasks[i]);
+        }
+    }
+    while (__atomic_load_n(&periodic.runs, __ATOMIC_RELAXED) < 5) {
+        sched_yield();
+    }
+    scheduler_cancel(sched, &periodic.task);
+    scheduler_wait(sched, &periodic.task); // Succeeds if the cancel caught it running
+    runs = periodic.runs;
+    usleep(3000);
+    check(periodic.runs == runs, "cancelled periodic task ran again", round);
+    scheduler_drain(sched);
+
+    for (i = 0; i < TREE_TASKS; i++) {
+        check(tree[i].runs == 1 && tree[i].task.task_complete_success, "tree task not run exactly once", round);
+    }
+    for (i = 0; i < EXTERNAL_TASKS; i++) {
+        check(external[i].runs == 1 && external[i].task.task_complete_success,
+              "external task not run exactly once", round);
+    }
+    for (i = 0; i < DELAYED_TASKS; i++) {
+        check(delayed[i].runs == 1, "delayed task not run exactly once", round);
+        check(delayed[i].ran_ns >= delayed[i].due_ns, "delayed task ran early", round);
+    }
+    for (i = 0; i < CANCELLED_TASKS; i++) {
+        check(cancelled[i].runs == 0 && cancelled[i].task.task_complete &&
+              !cancelled[i].task.task_complete_success, "cancelled task ran or succeeded", round);
+    }
+
+    test_task_init(&pending, sched, 0, count_run);
+    check(scheduler_submit_after(sched, &pending.task, 10000), "pending submit failed", round);
+    scheduler_destroy(sched);
+    check(pending.runs == 0 && pending.task.task_complete && !pending.task.task_complete_success,
+          "task pending at destroy ran or succeeded", round);
+    pthread_mutex_destroy(&mutex);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int rounds = argc > 1 ? strtoul(argv[1], NULL, 0) : 20;
+    unsigned int nr_workers = argc > 2 ? strtoul(argv[2], NULL, 0) : 4;
+    unsigned int round;
+
+    for (round = 0; round < rounds; round++) {
+        run_round(round, nr_workers);
+    }
+    printf("%u rounds with %u workers, %u failures\n", rounds, nr_workers, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,596 @@
+/* Task scheduler with per-worker queues, work stealing and a timer queue,
+ * see scheduler.h.
+ * For educational use only.
+ */
+
+#include "scheduler.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("scheduler: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("scheduler ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#define DEQUE_INITIAL_CAPACITY 64
+#define TIMERS_INITIAL_CAPACITY 64
+
+/* Tasks queued on one worker.  The owner pushes and pops the newest end, which keeps
+ * the data of a task it just queued warm, other workers steal from the oldest end.
+ * Positions are free-running and reduced with capacity - 1.
+ */
+struct task_deque {
+    pthread_mutex_t lock;
+    struct task **tasks;
+    size_t capacity; // Power of two
+    size_t head; // Oldest task, next to be stolen
+    size_t tail; // One past the newest task
+};
+
+struct worker {
+    struct scheduler *sched;
+    pthread_t thread;
+    struct task_deque deque;
+    unsigned int steal_seed; // Picks the first worker to steal from
+};
+
+struct scheduler {
+    struct worker *workers;
+    unsigned int nr_workers;
+    unsigned int next_worker; // Round robin target for tasks submitted from outside the workers
+
+    // Sleeping workers
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    unsigned long queued; // Tasks in worker deques
+    unsigned int idle_workers;
+    bool exiting;
+
+    // Delayed and periodic tasks
+    pthread_t timer_thread;
+    pthread_mutex_t timer_lock;
+    pthread_cond_t timer_cond; // On CLOCK_MONOTONIC
+    struct task **timers; // Min-heap on due_ns
+    size_t nr_timers;
+    size_t timers_capacity;
+
+    // Completion
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    unsigned long outstanding; // Submitted tasks not complete yet
+    bool stopping; // No more submissions, set under both done_lock and timer_lock
+};
+
+static __thread struct worker *current_worker;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool deque_push(struct task_deque *dq, struct task *task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail - dq->head == dq->capacity) {
+        size_t capacity = dq->capacity * 2;
+        struct task **tasks = malloc(capacity * sizeof(*tasks));
+        size_t i;
+
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            ERROR_LOG("Malloc failed to grow a task queue.");
+            return false;
+        }
+        for (i = dq->head; i != dq->tail; i++) {
+            tasks[i & (capacity - 1)] = dq->tasks[i & (dq->capacity - 1)];
+        }
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->capacity = capacity;
+    }
+    dq->tasks[dq->tail & (dq->capacity - 1)] = task;
+    dq->tail++;
+    pthread_mutex_unlock(&dq->lock);
+    return true;
+}
+
+static struct task *deque_pop_newest(struct task_deque *dq)
+{
+    struct task *task = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        dq->tail--;
+        task = dq->tasks[dq->tail & (dq->capacity - 1)];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static struct task *deque_steal_oldest(struct task_deque *dq)
+{
+    struct task *task = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        task = dq->tasks[dq->head & (dq->capacity - 1)];
+        dq->head++;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static void timers_swap(struct scheduler *sched, size_t a, size_t b)
+{
+    struct task *tmp = sched->timers[a];
+
+    sched->timers[a] = sched->timers[b];
+    sched->timers[b] = tmp;
+}
+
+static void timers_sift_down(struct scheduler *sched, size_t i)
+{
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+
+        if (left < sched->nr_timers && sched->timers[left]->due_ns < sched->timers[smallest]->due_ns) {
+            smallest = left;
+        }
+        if (right < sched->nr_timers && sched->timers[right]->due_ns < sched->timers[smallest]->due_ns) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        timers_swap(sched, i, smallest);
+        i = smallest;
+    }
+}
+
+static void timers_sift_up(struct scheduler *sched, size_t i)
+{
+    while (i > 0 && sched->timers[i]->due_ns < sched->timers[(i - 1) / 2]->due_ns) {
+        timers_swap(sched, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* Adds @param task to the timer heap, waking the timer thread if it is now the first due.
+ * Caller holds timer_lock.
+ * @return false if the heap could not grow
+ */
+static bool timers_push(struct scheduler *sched, struct task *task)
+{
+    if (sched->nr_timers == sched->timers_capacity) {
+        size_t capacity = sched->timers_capacity * 2;
+        struct task **timers = realloc(sched->timers, capacity * sizeof(*timers));
+
+        if (timers == NULL) {
+            ERROR_LOG("Malloc failed to grow the timer queue.");
+            return false;
+        }
+        sched->timers = timers;
+        sched->timers_capacity = capacity;
+    }
+    sched->timers[sched->nr_timers] = task;
+    timers_sift_up(sched, sched->nr_timers++);
+    if (sched->timers[0] == task) {
+        pthread_cond_signal(&sched->timer_cond);
+    }
+    return true;
+}
+
+/* Removes entry @param i from the timer heap.  Caller holds timer_lock.
+ */
+static void timers_remove(struct scheduler *sched, size_t i)
+{
+    sched->nr_timers--;
+    if (i == sched->nr_timers) {
+        return;
+    }
+    sched->timers[i] = sched->timers[sched->nr_timers];
+    timers_sift_down(sched, i);
+    timers_sift_up(sched, i);
+}
+
+/* Marks @param task complete with @param success and wakes its waiters.  The scheduler doesn't
+ * touch the task afterwards, its owner may free it as soon as it sees task_complete.
+ */
+static void scheduler_complete(struct scheduler *sched, struct task *task, bool success)
+{
+    pthread_mutex_lock(&sched->done_lock);
+    task->task_complete_success = success;
+    task->task_complete = true;
+    sched->outstanding--;
+    pthread_cond_broadcast(&sched->done_cond);
+    pthread_mutex_unlock(&sched->done_lock);
+}
+
+/* Queues @param task on the calling worker's deque, or round robin when called from another
+ * thread, and wakes a sleeping worker if there is one.
+ */
+static bool scheduler_queue(struct scheduler *sched, struct task *task)
+{
+    struct worker *worker = current_worker;
+
+    if (worker == NULL || worker->sched != sched) {
+        worker = &sched->workers[__atomic_fetch_add(&sched->next_worker, 1, __ATOMIC_RELAXED) %
+                                 sched->nr_workers];
+    }
+    if (!deque_push(&worker->deque, task)) {
+        return false;
+    }
+
+    // Pairs with the idle check in scheduler_worker(), one of us sees the other's update
+    __atomic_fetch_add(&sched->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->idle_workers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&sched->idle_lock);
+        pthread_cond_signal(&sched->idle_cond);
+        pthread_mutex_unlock(&sched->idle_lock);
+    }
+    return true;
+}
+
+/* Accounts for a new submission of @param task.
+ * @return false if the scheduler is shutting down
+ */
+static bool scheduler_admit(struct scheduler *sched, struct task *task, unsigned int period_ms)
+{
+    bool admitted;
+
+    task->task_complete = false;
+    task->task_complete_success = false;
+    task->cancelled = false;
+    task->period_ms = period_ms;
+
+    pthread_mutex_lock(&sched->done_lock);
+    admitted = !sched->stopping;
+    if (admitted) {
+        sched->outstanding++;
+    }
+    pthread_mutex_unlock(&sched->done_lock);
+    return admitted;
+}
+
+static void scheduler_run(struct scheduler *sched, struct task *task)
+{
+    bool success = task->fn(task);
+    uint64_t now;
+
+    if (task->period_ms != 0) {
+        pthread_mutex_lock(&sched->timer_lock);
+        if (!task->cancelled && !sched->stopping) {
+            // Keep to the original schedule unless a whole period was missed
+            now = now_ns();
+            task->due_ns += task->period_ms * 1000000ull;
+            if (task->due_ns < now) {
+                task->due_ns = now + task->period_ms * 1000000ull;
+            }
+            task->task_complete_success = success;
+            if (timers_push(sched, task)) {
+                pthread_mutex_unlock(&sched->timer_lock);
+                return;
+            }
+            success = false;
+        }
+        pthread_mutex_unlock(&sched->timer_lock);
+    }
+    scheduler_complete(sched, task, success);
+}
+
+static struct task *scheduler_steal(struct scheduler *sched, struct worker *self)
+{
+    unsigned int start = rand_r(&self->steal_seed) % sched->nr_workers;
+    struct task *task;
+    unsigned int i;
+
+    for (i = 0; i < sched->nr_workers; i++) {
+        struct worker *victim = &sched->workers[(start + i) % sched->nr_workers];
+
+        if (victim != self && (task = deque_steal_oldest(&victim->deque)) != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void *scheduler_worker(void *arg)
+{
+    struct worker *self = arg;
+    struct scheduler *sched = self->sched;
+    struct task *task;
+    bool exiting;
+
+    current_worker = self;
+    for (;;) {
+        task = deque_pop_newest(&self->deque);
+        if (task == NULL) {
+            task = scheduler_steal(sched, self);
+        }
+        if (task != NULL) {
+            __atomic_fetch_sub(&sched->queued, 1, __ATOMIC_SEQ_CST);
+            scheduler_run(sched, task);
+            continue;
+        }
+
+        // Nothing to run anywhere, sleep until a task is queued
+        pthread_mutex_lock(&sched->idle_lock);
+        __atomic_fetch_add(&sched->idle_workers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&sched->queued, __ATOMIC_SEQ_CST) == 0 && !sched->exiting) {
+            pthread_cond_wait(&sched->idle_cond, &sched->idle_lock);
+        }
+        __atomic_fetch_sub(&sched->idle_workers, 1, __ATOMIC_SEQ_CST);
+        exiting = sched->exiting && __atomic_load_n(&sched->queued, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&sched->idle_lock);
+        if (exiting) {
+            return NULL;
+        }
+    }
+}
+
+/* Moves delayed tasks to the worker queues as they become due
+ */
+static void *scheduler_timer(void *arg)
+{
+    struct scheduler *sched = arg;
+    struct timespec deadline;
+    struct task *task;
+
+    pthread_mutex_lock(&sched->timer_lock);
+    while (!sched->stopping) {
+        if (sched->nr_timers == 0) {
+            pthread_cond_wait(&sched->timer_cond, &sched->timer_lock);
+            continue;
+        }
+        task = sched->timers[0];
+        if (task->due_ns > now_ns()) {
+            deadline.tv_sec = task->due_ns / 1000000000ull;
+            deadline.tv_nsec = task->due_ns % 1000000000ull;
+            pthread_cond_timedwait(&sched->timer_cond, &sched->timer_lock, &deadline);
+            continue;
+        }
+
+        timers_remove(sched, 0);
+        pthread_mutex_unlock(&sched->timer_lock);
+        if (!scheduler_queue(sched, task)) {
+            scheduler_complete(sched, task, false);
+        }
+        pthread_mutex_lock(&sched->timer_lock);
+    }
+    pthread_mutex_unlock(&sched->timer_lock);
+    return NULL;
+}
+
+/* Releases what scheduler_create() set up, for the first @param nr_started workers
+ */
+static void scheduler_free(struct scheduler *sched, unsigned int nr_started)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_started; i++) {
+        pthread_mutex_destroy(&sched->workers[i].deque.lock);
+        free(sched->workers[i].deque.tasks);
+    }
+    pthread_mutex_destroy(&sched->idle_lock);
+    pthread_cond_destroy(&sched->idle_cond);
+    pthread_mutex_destroy(&sched->timer_lock);
+    pthread_cond_destroy(&sched->timer_cond);
+    pthread_mutex_destroy(&sched->done_lock);
+    pthread_cond_destroy(&sched->done_cond);
+    free(sched->timers);
+    free(sched->workers);
+    free(sched);
+}
+
+static void scheduler_stop_threads(struct scheduler *sched, unsigned int nr_started, bool timer_started)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&sched->idle_lock);
+    sched->exiting = true;
+    pthread_cond_broadcast(&sched->idle_cond);
+    pthread_mutex_unlock(&sched->idle_lock);
+    for (i = 0; i < nr_started; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
+    }
+
+    if (timer_started) {
+        // scheduler_destroy() already set stopping and woke it
+        pthread_join(sched->timer_thread, NULL);
+    }
+}
+
+struct scheduler *scheduler_create(unsigned int nr_workers)
+{
+    struct scheduler *sched;
+    pthread_condattr_t attr;
+    unsigned int i;
+    int rc;
+
+    if (nr_workers == 0) {
+        ERROR_LOG("A scheduler needs at least one worker.");
+        return NULL;
+    }
+
+    sched = calloc(1, sizeof(*sched));
+    if (sched == NULL || (sched->workers = calloc(nr_workers, sizeof(*sched->workers))) == NULL ||
+        (sched->timers = malloc(TIMERS_INITIAL_CAPACITY * sizeof(*sched->timers))) == NULL) {
+        ERROR_LOG("Malloc failed to allocate.");
+        if (sched != NULL) {
+            free(sched->workers);
+            free(sched);
+        }
+        return NULL;
+    }
+    sched->nr_workers = nr_workers;
+    sched->timers_capacity = TIMERS_INITIAL_CAPACITY;
+    pthread_mutex_init(&sched->idle_lock, NULL);
+    pthread_cond_init(&sched->idle_cond, NULL);
+    pthread_mutex_init(&sched->timer_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Delays are immune to wall clock changes
+    pthread_cond_init(&sched->timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&sched->done_lock, NULL);
+    pthread_cond_init(&sched->done_cond, NULL);
+
+    // Every deque must exist before the first worker tries to steal from it
+    for (i = 0; i < nr_workers; i++) {
+        struct worker *worker = &sched->workers[i];
+
+        worker->sched = sched;
+        worker->steal_seed = i + 1;
+        worker->deque.capacity = DEQUE_INITIAL_CAPACITY;
+        worker->deque.tasks = malloc(DEQUE_INITIAL_CAPACITY * sizeof(*worker->deque.tasks));
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        if (worker->deque.tasks == NULL) {
+            ERROR_LOG("Malloc failed to allocate.");
+            scheduler_free(sched, i + 1);
+            return NULL;
+        }
+    }
+    for (i = 0; i < nr_workers; i++) {
+        rc = pthread_create(&sched->workers[i].thread, NULL, scheduler_worker, &sched->workers[i]);
+        if (rc != 0) {
+            ERROR_LOG("pthread_create failed with %d", rc);
+            scheduler_stop_threads(sched, i, false);
+            scheduler_free(sched, nr_workers);
+            return NULL;
+        }
+    }
+
+    rc = pthread_create(&sched->timer_thread, NULL, scheduler_timer, sched);
+    if (rc != 0) {
+        ERROR_LOG("pthread_create failed with %d", rc);
+        scheduler_stop_threads(sched, nr_workers, false);
+        scheduler_free(sched, nr_workers);
+        return NULL;
+    }
+    DEBUG_LOG("Started %u workers", nr_workers);
+    return sched;
+}
+
+bool scheduler_submit(struct scheduler *sched, struct task *task)
+{
+    if (!scheduler_admit(sched, task, 0)) {
+        return false;
+    }
+    if (!scheduler_queue(sched, task)) {
+        scheduler_complete(sched, task, false);
+        return false;
+    }
+    return true;
+}
+
+/* Adds an admitted task to the timer heap, or completes it unsuccessfully if the scheduler
+ * started shutting down since it was admitted
+ */
+static bool scheduler_arm(struct scheduler *sched, struct task *task, unsigned int delay_ms)
+{
+    bool armed = false;
+
+    pthread_mutex_lock(&sched->timer_lock);
+    task->due_ns = now_ns() + delay_ms * 1000000ull;
+    if (!sched->stopping) {
+        armed = timers_push(sched, task);
+    }
+    pthread_mutex_unlock(&sched->timer_lock);
+    if (!armed) {
+        scheduler_complete(sched, task, false);
+    }
+    return armed;
+}
+
+bool scheduler_submit_after(struct scheduler *sched, struct task *task, unsigned int delay_ms)
+{
+    if (!scheduler_admit(sched, task, 0)) {
+        return false;
+    }
+    return scheduler_arm(sched, task, delay_ms);
+}
+
+bool scheduler_submit_every(struct scheduler *sched, struct task *task, unsigned int period_ms)
+{
+    if (period_ms == 0 || !scheduler_admit(sched, task, period_ms)) {
+        return false;
+    }
+    return scheduler_arm(sched, task, period_ms);
+}
+
+void scheduler_cancel(struct scheduler *sched, struct task *task)
+{
+    bool removed = false;
+    size_t i;
+
+    pthread_mutex_lock(&sched->timer_lock);
+    task->cancelled = true; // A periodic task that is running now won't be rearmed
+    for (i = 0; i < sched->nr_timers; i++) {
+        if (sched->timers[i] == task) {
+            timers_remove(sched, i);
+            removed = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sched->timer_lock);
+    if (removed) {
+        scheduler_complete(sched, task, false);
+    }
+}
+
+bool scheduler_wait(struct scheduler *sched, struct task *task)
+{
+    bool success;
+
+    pthread_mutex_lock(&sched->done_lock);
+    while (!task->task_complete) {
+        pthread_cond_wait(&sched->done_cond, &sched->done_lock);
+    }
+    success = task->task_complete_success;
+    pthread_mutex_unlock(&sched->done_lock);
+    return success;
+}
+
+void scheduler_drain(struct scheduler *sched)
+{
+    pthread_mutex_lock(&sched->done_lock);
+    while (sched->outstanding > 0) {
+        pthread_cond_wait(&sched->done_cond, &sched->done_lock);
+    }
+    pthread_mutex_unlock(&sched->done_lock);
+}
+
+void scheduler_destroy(struct scheduler *sched)
+{
+    struct task **cancelled;
+    size_t nr_cancelled;
+    size_t i;
+
+    // Stop submissions and take what is waiting on the timer, complete it outside the locks
+    pthread_mutex_lock(&sched->done_lock);
+    pthread_mutex_lock(&sched->timer_lock);
+    sched->stopping = true;
+    cancelled = sched->timers;
+    nr_cancelled = sched->nr_timers;
+    sched->timers = NULL;
+    sched->nr_timers = 0;
+    sched->timers_capacity = 0;
+    pthread_cond_signal(&sched->timer_cond);
+    pthread_mutex_unlock(&sched->timer_lock);
+    pthread_mutex_unlock(&sched->done_lock);
+    for (i = 0; i < nr_cancelled; i++) {
+        scheduler_complete(sched, cancelled[i], false);
+    }
+    free(cancelled);
+
+    scheduler_drain(sched);
+    scheduler_stop_threads(sched, sched->nr_workers, true);
+    scheduler_free(sched, sched->nr_workers);
+}
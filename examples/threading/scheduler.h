@@ -0,0 +1,84 @@
+/* Task scheduler for running many short or delayed jobs on a fixed pool of
+ * worker threads, instead of one thread per job.
+ * For educational use only.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct scheduler;
+
+/**
+ * A unit of work.  Allocated and owned by the caller, which must keep it valid
+ * from submission until task_complete is set.  Like struct thread_data, the
+ * outcome is reported in the structure itself.
+ */
+struct task {
+    bool (*fn)(struct task *task); // Work to run, returns whether it succeeded
+    void *arg; // For use by fn
+    bool task_complete; // Set once the task has run, or was cancelled before it could
+    bool task_complete_success; // Return value of fn, false if cancelled
+
+    // Owned by the scheduler while the task is submitted
+    uint64_t due_ns; // When a delayed task becomes runnable, CLOCK_MONOTONIC
+    unsigned int period_ms; // Rerun interval of a periodic task, 0 for one-shot
+    bool cancelled;
+};
+
+/**
+* Starts a scheduler with @param nr_workers worker threads, plus a timer thread for delayed tasks.
+* Each worker has its own task queue.  Tasks submitted from a worker go to its own queue and run
+* newest first.  Idle workers steal the oldest tasks from other workers' queues.
+* @return the scheduler, or NULL if it could not be started
+*/
+struct scheduler *scheduler_create(unsigned int nr_workers);
+
+/**
+* Queues @param task to run as soon as a worker is free.
+* @return false if the scheduler is shutting down or out of memory
+*/
+bool scheduler_submit(struct scheduler *sched, struct task *task);
+
+/**
+* Queues @param task to run once @param delay_ms milliseconds have passed.  No thread sleeps on
+* behalf of the task meanwhile.
+* @return false if the scheduler is shutting down or out of memory
+*/
+bool scheduler_submit_after(struct scheduler *sched, struct task *task, unsigned int delay_ms);
+
+/**
+* Runs @param task every @param period_ms milliseconds, the first time one period from now,
+* until it is cancelled with scheduler_cancel() or the scheduler is destroyed.  task_complete
+* is only set then, task_complete_success holds the result of the last run.
+* @return false if the scheduler is shutting down or out of memory
+*/
+bool scheduler_submit_every(struct scheduler *sched, struct task *task, unsigned int period_ms);
+
+/**
+* Cancels @param task if it is still waiting for its delay or period to pass, marking it complete
+* without success.  A task already running finishes, a periodic one is not run again.
+*/
+void scheduler_cancel(struct scheduler *sched, struct task *task);
+
+/**
+* Blocks until @param task is complete.  Returns task_complete_success.
+*/
+bool scheduler_wait(struct scheduler *sched, struct task *task);
+
+/**
+* Blocks until every submitted task is complete.  Periodic tasks never complete on their own,
+* cancel them first.
+*/
+void scheduler_drain(struct scheduler *sched);
+
+/**
+* Cancels delayed and periodic tasks, runs the tasks already queued, then stops the threads and
+* frees @param sched.
+*/
+void scheduler_destroy(struct scheduler *sched);
+
+#endif /* SCHEDULER_H */
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Compares the report of the native finder, with and without an index, against finder.sh
+# on random flat directories, for plain, regex and newline-separated search strings.
+# Usage: finder-compare.sh [numfiles]
+
+set -e
+set -u
+
+NUMFILES=${1:-100}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+failures=0
+
+mkdir "$DIR/random" "$DIR/fixed"
+awk -v n="$NUMFILES" -v dir="$DIR/random" 'BEGIN {
+	srand(1)
+	for (f = 0; f < n; f++) {
+		file = dir "/f" f
+		printf "" > file
+		lines = int(rand() * 20)
+		for (l = 0; l < lines; l++) {
+			s = ""
+			len = int(rand() * 12)
+			for (c = 0; c < len; c++) {
+				s = s substr("abcdx .", int(rand() * 7) + 1, 1)
+			}
+			# Some files lack a final newline
+			if (l == lines - 1 && rand() < 0.3) {
+				printf "%s", s > file
+			} else {
+				print s > file
+			}
+		}
+		close(file)
+	}
+}'
+printf 'a\0abc\nabcabc\n' > "$DIR/random/nul1"
+printf 'x\nb\0cd\0\n' > "$DIR/random/nul2"
+printf 'ab\ncd\nx\n' > "$DIR/fixed/f"
+
+# check dir searchstr [expected matching lines]
+check() {
+	expected=$(./finder.sh "$1" "$2")
+	if [ $# -gt 2 ] && [ "$expected" = "${expected%lines are $3}" ]
+	then
+		echo "FAILED: finder.sh '$2' on $1: $expected, expected $3 lines"
+		failures=$((failures + 1))
+	fi
+	for finder in "./finder" "./finder -i $DIR/index"
+	do
+		actual=$($finder "$1" "$2")
+		if [ "$actual" != "$expected" ]
+		then
+			echo "FAILED: $finder '$2' on $1: $actual"
+			echo "        finder.sh: $expected"
+			failures=$((failures + 1))
+		fi
+	done
+}
+
+NL='
+'
+check "$DIR/fixed" "b${NL}c" 2
+check "$DIR/fixed" "x${NL}zz" 1
+check "$DIR/fixed" "^c${NL}x\$" 2
+for searchstr in "" a ab abc "a b" "x." "^a" "a*b\$" "[bc]d" \
+	"b${NL}c" "x${NL}zz" "abc${NL}d" "^c${NL}ab" "dx${NL}.a" "zzz${NL}abcd" "${NL}a"
+do
+	check "$DIR/random" "$searchstr"
+done
+
+echo "$failures failures"
+[ $failures -eq 0 ]
@@ -0,0 +1,824 @@
+/* Trigram index for repeated finder searches over the same tree.
+ *
+ * The index file lists every file of the tree with its size and mtime, and
+ * for every trigram (three consecutive bytes) that occurs in some file, the
+ * sorted ids of the files containing it.  It is written once and mmap()ed
+ * by later runs:
+ *
+ *   struct index_header
+ *   struct index_file      files[nfiles], sorted by path
+ *   struct index_trigram   trigrams[ntrigrams], sorted by trigram
+ *   uint32_t               postings[], file ids of each trigram in turn
+ *   char                   strings[], the root and file paths
+ *
+ * Each run walks the tree and stats every file, then only re-reads the
+ * files whose size or mtime changed, or that are new.  The postings of
+ * unchanged files are carried over from the old index.  A search string of
+ * three or more plain bytes is then looked up by intersecting the postings
+ * of its trigrams, and only the resulting candidate files are read to count
+ * matching lines.  Shorter strings and regular expressions have no trigrams
+ * to look up, so they still read every file.
+ *
+ * For educational use only.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "finder.h"
+
+#define INDEX_MAGIC "FNDIDX01"
+#define TRIGRAM_SPACE (1u << 24)
+#define RADIX_BITS 12
+
+struct index_header {
+    char magic[8];
+    uint32_t nfiles;
+    uint32_t ntrigrams;
+    uint64_t npostings;
+    uint64_t strings_size;
+    uint64_t root_off; // Offsets into strings
+    uint32_t root_len;
+    uint32_t reserved;
+};
+
+struct index_file {
+    uint64_t mtime_ns;
+    uint64_t size;
+    uint64_t path_off;
+    uint32_t path_len;
+    uint32_t reserved;
+};
+
+struct index_trigram {
+    uint32_t trigram; // First byte in bits 16-23
+    uint32_t count;
+    uint64_t postings_off; // Index of the first file id in postings
+};
+
+/* A mapped index file, or an index image built by this run */
+struct index {
+    void *map;
+    size_t map_size;
+    const struct index_header *header;
+    const struct index_file *files;
+    const struct index_trigram *trigrams;
+    const uint32_t *postings;
+    const char *strings;
+};
+
+/* A file found by this run's walk */
+struct tree_file {
+    char *path;
+    uint64_t mtime_ns;
+    uint64_t size;
+    uint32_t *trigrams; // Distinct trigrams of a file that had to be read, NULL if carried over
+    size_t ntrigrams;
+    int64_t old_id; // Id in the old index if unchanged, else -1
+};
+
+struct tree {
+    pthread_mutex_t lock;
+    struct tree_file *files;
+    size_t count;
+    size_t capacity;
+};
+
+/* Work shared by the threads of finder_parallel() */
+struct parallel_work {
+    struct tree *tree;
+    const uint32_t *ids; // Files to process
+    size_t count;
+    size_t next; // Next entry of ids to take
+    unsigned long lines;
+};
+
+static struct tree tree = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t stat_mtime_ns(const struct stat *st)
+{
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+}
+
+static uint32_t trigram_at(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static void collect_file(int dirfd, const char *dir, const char *name)
+{
+    struct tree_file file;
+    struct stat st;
+
+    if (fstatat(dirfd, name, &st, 0) != 0) {
+        fprintf(stderr, "finder: %s/%s: %s\n", dir, name, strerror(errno));
+        return;
+    }
+    memset(&file, 0, sizeof(file));
+    file.path = malloc(strlen(dir) + strlen(name) + 2);
+    if (file.path == NULL) {
+        perror("finder: malloc");
+        exit(1);
+    }
+    sprintf(file.path, "%s/%s", dir, name);
+    file.mtime_ns = stat_mtime_ns(&st);
+    file.size = st.st_size;
+    file.old_id = -1;
+
+    pthread_mutex_lock(&tree.lock);
+    if (tree.count == tree.capacity) {
+        tree.capacity = tree.capacity ? tree.capacity * 2 : 256;
+        tree.files = realloc(tree.files, tree.capacity * sizeof(*tree.files));
+        if (tree.files == NULL) {
+            perror("finder: realloc");
+            exit(1);
+        }
+    }
+    tree.files[tree.count++] = file;
+    pthread_mutex_unlock(&tree.lock);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(((const struct tree_file *)a)->path, ((const struct tree_file *)b)->path);
+}
+
+/* Sorts keys of trigram << 32 | file id, where file ids are below 1 << id_bits.  A stable
+ * radix sort over just the bits in use, trees easily have tens of millions of keys.
+ */
+static void sort_keys(uint64_t *keys, size_t count, unsigned int id_bits)
+{
+    unsigned int shifts[8];
+    unsigned int npasses = 0;
+    uint64_t *tmp = malloc((count ? count : 1) * sizeof(*tmp));
+    unsigned int shift;
+    unsigned int pass;
+    size_t i;
+
+    if (tmp == NULL) {
+        perror("finder: malloc");
+        exit(1);
+    }
+    for (shift = 0; shift < id_bits; shift += RADIX_BITS) {
+        shifts[npasses++] = shift;
+    }
+    for (shift = 32; shift < 56; shift += RADIX_BITS) {
+        shifts[npasses++] = shift;
+    }
+    for (pass = 0; pass < npasses; pass++) {
+        size_t counts[1 << RADIX_BITS] = {0};
+        size_t total = 0;
+        uint64_t *swap;
+
+        for (i = 0; i < count; i++) {
+            counts[keys[i] >> shifts[pass] & ((1 << RADIX_BITS) - 1)]++;
+        }
+        for (i = 0; i < 1 << RADIX_BITS; i++) {
+            size_t n = counts[i];
+
+            counts[i] = total;
+            total += n;
+        }
+        for (i = 0; i < count; i++) {
+            tmp[counts[keys[i] >> shifts[pass] & ((1 << RADIX_BITS) - 1)]++] = keys[i];
+        }
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    // After an odd number of passes the sorted keys are in the scratch buffer
+    if (npasses % 2 != 0) {
+        memcpy(tmp, keys, count * sizeof(*keys));
+        free(keys);
+    } else {
+        free(tmp);
+    }
+}
+
+static void index_unmap(struct index *index)
+{
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+/* Points the section pointers of index at the image in its map */
+static void index_set_sections(struct index *index)
+{
+    index->header = index->map;
+    index->files = (const struct index_file *)(index->header + 1);
+    index->trigrams = (const struct index_trigram *)(index->files + index->header->nfiles);
+    index->postings = (const uint32_t *)(index->trigrams + index->header->ntrigrams);
+    index->strings = (const char *)(index->postings + index->header->npostings);
+}
+
+/* Maps the index at path and checks every offset and file id in it is in bounds, so
+ * the rest of the code can trust it.  Returns false if there is no usable index.
+ */
+static bool index_map(struct index *index, const char *path)
+{
+    const struct index_header *header;
+    struct stat st;
+    uint64_t size;
+    uint64_t i;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct index_header)) {
+        close(fd);
+        return false;
+    }
+    index->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED) {
+        index->map = NULL;
+        return false;
+    }
+    index->map_size = st.st_size;
+
+    header = index->map;
+    size = sizeof(*header) + (uint64_t)header->nfiles * sizeof(struct index_file) +
+           (uint64_t)header->ntrigrams * sizeof(struct index_trigram) + header->npostings * sizeof(uint32_t) +
+           header->strings_size;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || size != (uint64_t)st.st_size ||
+        header->root_off + header->root_len > header->strings_size) {
+        index_unmap(index);
+        return false;
+    }
+    index_set_sections(index);
+
+    for (i = 0; i < header->nfiles; i++) {
+        if (index->files[i].path_off + index->files[i].path_len > header->strings_size) {
+            index_unmap(index);
+            return false;
+        }
+    }
+    for (i = 0; i < header->ntrigrams; i++) {
+        if (index->trigrams[i].postings_off + index->trigrams[i].count > header->npostings) {
+            index_unmap(index);
+            return false;
+        }
+    }
+    for (i = 0; i < header->npostings; i++) {
+        if (index->postings[i] >= header->nfiles) {
+            index_unmap(index);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Matches the walked files against the old index by path, marking the unchanged ones with old_id.
+ * Returns how many files have to be read.
+ */
+static size_t match_old_files(const struct index *old)
+{
+    size_t changed = 0;
+    uint32_t id = 0;
+    size_t i;
+
+    for (i = 0; i < tree.count; i++) {
+        struct tree_file *file = &tree.files[i];
+        int cmp = 1;
+
+        // Both lists are sorted by path
+        while (old->header != NULL && id < old->header->nfiles) {
+            const struct index_file *old_file = &old->files[id];
+            size_t len = strlen(file->path);
+
+            cmp = memcmp(old->strings + old_file->path_off, file->path,
+                         len < old_file->path_len ? len : old_file->path_len);
+            if (cmp == 0) {
+                cmp = old_file->path_len < len ? -1 : old_file->path_len > len;
+            }
+            if (cmp >= 0) {
+                break;
+            }
+            id++;
+        }
+        if (cmp == 0 && old->files[id].mtime_ns == file->mtime_ns && old->files[id].size == file->size) {
+            file->old_id = id;
+        } else {
+            changed++;
+        }
+    }
+    return changed;
+}
+
+/* Reads a file and records its distinct trigrams.  seen is a scratch bitmap of all
+ * trigrams, left cleared.
+ */
+static void read_trigrams(struct tree_file *file, uint64_t *seen)
+{
+    const unsigned char *data;
+    size_t capacity = 0;
+    struct stat st;
+    size_t i;
+    int fd;
+
+    fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "finder: %s: %s\n", file->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    if (st.st_size < 3) {
+        close(fd);
+        return;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "finder: %s: %s\n", file->path, strerror(errno));
+        return;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    for (i = 0; i + 3 <= (size_t)st.st_size; i++) {
+        uint32_t trigram;
+
+        // A search string never spans lines, so trigrams with a newline are never looked up
+        if (data[i] == '\n') {
+            continue;
+        }
+        if (data[i + 2] == '\n') {
+            i += 2;
+            continue;
+        }
+        if (data[i + 1] == '\n') {
+            i++;
+            continue;
+        }
+        trigram = trigram_at(data + i);
+        if (seen[trigram / 64] & 1ull << (trigram % 64)) {
+            continue;
+        }
+        seen[trigram / 64] |= 1ull << (trigram % 64);
+        if (file->ntrigrams == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            file->trigrams = realloc(file->trigrams, capacity * sizeof(*file->trigrams));
+            if (file->trigrams == NULL) {
+                perror("finder: realloc");
+                exit(1);
+            }
+        }
+        file->trigrams[file->ntrigrams++] = trigram;
+    }
+    munmap((void *)data, st.st_size);
+
+    for (i = 0; i < file->ntrigrams; i++) {
+        seen[file->trigrams[i] / 64] = 0;
+    }
+}
+
+static void *trigram_worker(void *arg)
+{
+    struct parallel_work *work = arg;
+    uint64_t *seen = calloc(TRIGRAM_SPACE / 64, sizeof(*seen));
+    size_t i;
+
+    if (seen == NULL) {
+        perror("finder: calloc");
+        exit(1);
+    }
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->count) {
+        read_trigrams(&work->tree->files[work->ids[i]], seen);
+    }
+    free(seen);
+    return NULL;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Builds the index image of the walked files in an anonymous mapping, laid out as the file.
+ * keys holds trigram << 32 | file id for every trigram of every file, sorted.
+ */
+static void build_index(struct index *index, const char *root, const uint64_t *keys, size_t nkeys)
+{
+    struct index_header *header;
+    struct index_file *files;
+    struct index_trigram *trigrams;
+    uint32_t *postings;
+    char *strings;
+    uint64_t strings_size = strlen(root);
+    size_t ntrigrams = 0;
+    size_t i;
+
+    for (i = 0; i < nkeys; i++) {
+        ntrigrams += i == 0 || keys[i] >> 32 != keys[i - 1] >> 32;
+    }
+    for (i = 0; i < tree.count; i++) {
+        strings_size += strlen(tree.files[i].path);
+    }
+    memset(index, 0, sizeof(*index));
+    index->map_size = sizeof(*header) + tree.count * sizeof(*files) + ntrigrams * sizeof(*trigrams) +
+                      nkeys * sizeof(*postings) + strings_size;
+    index->map = mmap(NULL, index->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (index->map == MAP_FAILED) {
+        perror("finder: mmap");
+        exit(1);
+    }
+
+    header = index->map;
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->nfiles = tree.count;
+    header->ntrigrams = ntrigrams;
+    header->npostings = nkeys;
+    header->strings_size = strings_size;
+    header->root_len = strlen(root);
+    index_set_sections(index);
+    files = (struct index_file *)index->files;
+    trigrams = (struct index_trigram *)index->trigrams;
+    postings = (uint32_t *)index->postings;
+    strings = (char *)index->strings;
+
+    memcpy(strings, root, header->root_len);
+    strings_size = header->root_len;
+    for (i = 0; i < tree.count; i++) {
+        files[i].mtime_ns = tree.files[i].mtime_ns;
+        files[i].size = tree.files[i].size;
+        files[i].path_off = strings_size;
+        files[i].path_len = strlen(tree.files[i].path);
+        memcpy(strings + strings_size, tree.files[i].path, files[i].path_len);
+        strings_size += files[i].path_len;
+    }
+    ntrigrams = 0;
+    for (i = 0; i < nkeys; i++) {
+        uint32_t trigram = keys[i] >> 32;
+
+        if (ntrigrams == 0 || trigrams[ntrigrams - 1].trigram != trigram) {
+            trigrams[ntrigrams].trigram = trigram;
+            trigrams[ntrigrams].postings_off = i;
+            ntrigrams++;
+        }
+        trigrams[ntrigrams - 1].count++;
+        postings[i] = (uint32_t)keys[i];
+    }
+}
+
+/* Writes the image of index to path, through a temporary file renamed over it */
+static bool write_index(const char *path, const struct index *index)
+{
+    char *tmp_path = malloc(strlen(path) + 5);
+    bool ok = false;
+    int fd = -1;
+
+    if (tmp_path == NULL) {
+        goto out;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || !write_all(fd, index->map, index->map_size)) {
+        goto out;
+    }
+    if (close(fd) != 0) {
+        fd = -1;
+        goto out;
+    }
+    fd = -1;
+    ok = rename(tmp_path, path) == 0;
+
+out:
+    if (!ok) {
+        fprintf(stderr, "finder: writing index %s failed, searching without saving it: %s\n", path,
+                strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (tmp_path != NULL) {
+            unlink(tmp_path);
+        }
+    }
+    free(tmp_path);
+    return ok;
+}
+
+/* Rebuilds the index from the walked files into fresh, reading those that changed since old,
+ * and saves it to index_path.  fresh is used for this run even if saving it fails.
+ * Returns false if nothing changed and old is still current.
+ */
+static bool update_index(const char *index_path, const char *root, const struct index *old,
+                         struct index *fresh_index)
+{
+    struct parallel_work work;
+    uint32_t *changed_ids;
+    uint64_t *fresh;
+    uint64_t *keys;
+    size_t nfresh = 0;
+    size_t nkeys = 0;
+    unsigned int id_bits;
+    size_t changed;
+    size_t i;
+    uint64_t j;
+
+    changed = match_old_files(old);
+    if (changed == 0 && old->header != NULL && old->header->nfiles == tree.count) {
+        return false;
+    }
+
+    changed_ids = malloc((changed ? changed : 1) * sizeof(*changed_ids));
+    if (changed_ids == NULL) {
+        perror("finder: malloc");
+        exit(1);
+    }
+    for (i = 0, changed = 0; i < tree.count; i++) {
+        if (tree.files[i].old_id < 0) {
+            changed_ids[changed++] = i;
+        }
+    }
+    memset(&work, 0, sizeof(work));
+    work.tree = &tree;
+    work.ids = changed_ids;
+    work.count = changed;
+    finder_parallel(trigram_worker, &work);
+    free(changed_ids);
+
+    // Postings of the files just read, sorted here
+    for (i = 0; i < tree.count; i++) {
+        nfresh += tree.files[i].ntrigrams;
+    }
+    fresh = malloc((nfresh ? nfresh : 1) * sizeof(*fresh));
+    if (fresh == NULL) {
+        perror("finder: malloc");
+        exit(1);
+    }
+    nfresh = 0;
+    for (i = 0; i < tree.count; i++) {
+        for (j = 0; j < tree.files[i].ntrigrams; j++) {
+            fresh[nfresh++] = (uint64_t)tree.files[i].trigrams[j] << 32 | i;
+        }
+    }
+    for (id_bits = 0; id_bits < 32 && (size_t)1 << id_bits < tree.count; id_bits++) {
+    }
+    sort_keys(fresh, nfresh, id_bits);
+
+    keys = malloc((nfresh + (old->header != NULL ? old->header->npostings : 0) + 1) * sizeof(*keys));
+    if (keys == NULL) {
+        perror("finder: malloc");
+        exit(1);
+    }
+    if (old->header != NULL) {
+        /* Merge in the postings of unchanged files.  Old and new ids are both in path order,
+         * so the carried postings come out of the old index already sorted.
+         */
+        int64_t *new_ids = malloc((old->header->nfiles ? old->header->nfiles : 1) * sizeof(*new_ids));
+        size_t next_fresh = 0;
+
+        if (new_ids == NULL) {
+            perror("finder: malloc");
+            exit(1);
+        }
+        for (i = 0; i < old->header->nfiles; i++) {
+            new_ids[i] = -1;
+        }
+        for (i = 0; i < tree.count; i++) {
+            if (tree.files[i].old_id >= 0) {
+                new_ids[tree.files[i].old_id] = i;
+            }
+        }
+        for (i = 0; i < old->header->ntrigrams; i++) {
+            const struct index_trigram *t = &old->trigrams[i];
+
+            for (j = t->postings_off; j < t->postings_off + t->count; j++) {
+                uint32_t id = old->postings[j];
+                uint64_t key;
+
+                if (new_ids[id] < 0) {
+                    continue;
+                }
+                key = (uint64_t)t->trigram << 32 | new_ids[id];
+                while (next_fresh < nfresh && fresh[next_fresh] < key) {
+                    keys[nkeys++] = fresh[next_fresh++];
+                }
+                keys[nkeys++] = key;
+            }
+        }
+        while (next_fresh < nfresh) {
+            keys[nkeys++] = fresh[next_fresh++];
+        }
+        free(new_ids);
+    } else {
+        memcpy(keys, fresh, nfresh * sizeof(*keys));
+        nkeys = nfresh;
+    }
+    free(fresh);
+
+    build_index(fresh_index, root, keys, nkeys);
+    free(keys);
+    write_index(index_path, fresh_index);
+    return true;
+}
+
+static const struct index_trigram *lookup_trigram(const struct index *index, uint32_t trigram)
+{
+    size_t low = 0;
+    size_t high = index->header->ntrigrams;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (index->trigrams[mid].trigram < trigram) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < index->header->ntrigrams && index->trigrams[low].trigram == trigram) {
+        return &index->trigrams[low];
+    }
+    return NULL;
+}
+
+/* Returns the ids of the files that contain every trigram of pattern, in candidates, and
+ * their number, or SIZE_MAX if it is too short to have trigrams to look up.
+ */
+static size_t pattern_candidates(const struct index *index, const struct finder_pattern *pattern,
+                                 uint32_t *candidates)
+{
+    const unsigned char *needle = (const unsigned char *)pattern->str;
+    const struct index_trigram *rarest = NULL;
+    size_t count = 0;
+    size_t i;
+    uint64_t j;
+
+    if (pattern->len < 3) {
+        return SIZE_MAX;
+    }
+
+    // Start from the trigram with the fewest files, then drop candidates missing any other
+    for (i = 0; i + 3 <= pattern->len; i++) {
+        const struct index_trigram *t = lookup_trigram(index, trigram_at(needle + i));
+
+        if (t == NULL) {
+            return 0;
+        }
+        if (rarest == NULL || t->count < rarest->count) {
+            rarest = t;
+        }
+    }
+    for (j = rarest->postings_off; j < rarest->postings_off + rarest->count; j++) {
+        candidates[count++] = index->postings[j];
+    }
+    for (i = 0; i + 3 <= pattern->len && count > 0; i++) {
+        const struct index_trigram *t = lookup_trigram(index, trigram_at(needle + i));
+        const uint32_t *postings = index->postings + t->postings_off;
+        size_t kept = 0;
+        size_t k = 0;
+
+        if (t == rarest) {
+            continue;
+        }
+        // Both lists are sorted file ids
+        for (j = 0; j < count; j++) {
+            while (k < t->count && postings[k] < candidates[j]) {
+                k++;
+            }
+            if (k < t->count && postings[k] == candidates[j]) {
+                candidates[kept++] = candidates[j];
+            }
+        }
+        count = kept;
+    }
+    return count;
+}
+
+/* Returns the ids of the files that may match any pattern, in candidates, and their number.
+ * That is the union of the candidates of each pattern.  With a regex, or a pattern without
+ * trigrams to look up, every file is a candidate.
+ */
+static size_t find_candidates(const struct index *index, uint32_t *candidates)
+{
+    size_t nfiles = index->header->nfiles;
+    uint32_t *scratch;
+    bool *found;
+    size_t count;
+    size_t i;
+    size_t j;
+
+    if (!use_regex && npatterns == 1) {
+        count = pattern_candidates(index, &patterns[0], candidates);
+        if (count != SIZE_MAX) {
+            return count;
+        }
+    }
+
+    scratch = malloc((nfiles ? nfiles : 1) * sizeof(*scratch));
+    found = calloc(nfiles ? nfiles : 1, sizeof(*found));
+    if (scratch == NULL || found == NULL) {
+        perror("finder: malloc");
+        exit(1);
+    }
+    for (i = 0; i < npatterns; i++) {
+        count = use_regex ? SIZE_MAX : pattern_candidates(index, &patterns[i], scratch);
+        if (count == SIZE_MAX) {
+            memset(found, true, nfiles * sizeof(*found));
+            break;
+        }
+        for (j = 0; j < count; j++) {
+            found[scratch[j]] = true;
+        }
+    }
+    count = 0;
+    for (i = 0; i < nfiles; i++) {
+        if (found[i]) {
+            candidates[count++] = i;
+        }
+    }
+    free(found);
+    free(scratch);
+    return count;
+}
+
+/* Counts the matching lines of candidate files, reading each in full */
+static void *verify_worker(void *arg)
+{
+    struct parallel_work *work = arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->count) {
+        const struct tree_file *file = &work->tree->files[work->ids[i]];
+
+        __atomic_fetch_add(&work->lines, finder_count_file(AT_FDCWD, NULL, file->path), __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int finder_index_search(const char *index_path, const char *root, unsigned long *files, unsigned long *lines)
+{
+    struct parallel_work work;
+    struct index index;
+    struct index fresh;
+    uint32_t *candidates;
+    size_t i;
+
+    finder_walk(root, collect_file);
+    qsort(tree.files, tree.count, sizeof(*tree.files), compare_paths);
+
+    // An index of another tree is of no use, start over
+    if (index_map(&index, index_path) &&
+        (index.header->root_len != strlen(root) ||
+         memcmp(index.strings + index.header->root_off, root, index.header->root_len) != 0)) {
+        index_unmap(&index);
+    }
+    if (update_index(index_path, root, &index, &fresh)) {
+        index_unmap(&index);
+        index = fresh;
+    }
+
+    candidates = malloc((tree.count ? tree.count : 1) * sizeof(*candidates));
+    if (candidates == NULL) {
+        perror("finder: malloc");
+        return 1;
+    }
+    memset(&work, 0, sizeof(work));
+    work.tree = &tree;
+    work.ids = candidates;
+    work.count = find_candidates(&index, candidates);
+    finder_parallel(verify_worker, &work);
+
+    *files = tree.count;
+    *lines = work.lines;
+
+    free(candidates);
+    index_unmap(&index);
+    for (i = 0; i < tree.count; i++) {
+        free(tree.files[i].path);
+        free(tree.files[i].trigrams);
+    }
+    free(tree.files);
+    return 0;
+}
@@ -53,12 +53,20 @@ fi
 #make clean
 #make
 
+# Write all files from one writer process, backslashes in the string are escaped for the manifest
+MANIFESTSTR=$(printf '%s' "$WRITESTR" | sed 's/\\/\\\\/g')
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "$WRITEDIR/${username}$i.txt" "$MANIFESTSTR"
+done | writer -m -
 
-OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
+# Use the compiled finder when it is installed, its report matches finder.sh
+if command -v finder > /dev/null
+then
+	OUTPUTSTRING=$(finder "$WRITEDIR" "$WRITESTR")
+else
+	OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
+fi
 
 echo ${OUTPUTSTRING} > /tmp/assignment4-result.txt
 
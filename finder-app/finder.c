@@ -0,0 +1,513 @@
+/* Native finder for CU Boulder ECEN 5713, a compiled drop-in for finder.sh.
+ *
+ * Prints the same report as finder.sh: how many files are under filesdir and
+ * how many of their lines contain searchstr.  Instead of one grep process
+ * per file, worker threads walk the tree with getdents64(), mmap() each file
+ * and count matching lines in place.
+ *
+ * searchstr is a grep basic regular expression, as in finder.sh.  Plain
+ * strings, the common case, are found with a vectorized substring search,
+ * anything using regex syntax goes through regexec() line by line.  Like
+ * grep, a searchstr holding newlines is a list of patterns, one per line,
+ * and a line matches if any of them does.
+ *
+ * Unlike finder.sh, subdirectories are searched recursively rather than
+ * counted as files.  Hidden entries are skipped, like the shell glob does.
+ *
+ * With -i indexfile the search goes through a trigram index instead, see
+ * finder-index.c.
+ *
+ * For educational use only.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "finder.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define NUM_PARAMS 2
+#define DENTS_BUFFER_SIZE (64 * 1024)
+#define MAX_THREADS 16
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Directories waiting to be read, shared by the worker threads */
+struct dir_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char **dirs;
+    size_t count;
+    size_t capacity;
+    unsigned int busy; // Workers reading a directory, which may add more
+};
+
+static struct dir_queue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+static finder_visit_fn visit_file;
+static unsigned int nthreads;
+struct finder_pattern *patterns;
+size_t npatterns;
+bool use_regex;
+static regex_t *search_regexes; // One per pattern when use_regex
+static unsigned long total_files;
+static unsigned long total_lines;
+
+/* Returns the first occurrence of needle in haystack, or NULL.  Compares the first and
+ * last byte of the needle at 16 positions at once and only checks the rest where both match.
+ */
+static const char *find(const char *haystack, size_t len, const char *needle, size_t n)
+{
+    size_t i = 0;
+
+    if (n == 0) {
+        return haystack;
+    }
+    if (n > len) {
+        return NULL;
+    }
+#ifdef __SSE2__
+    if (n > 1) {
+        const __m128i first = _mm_set1_epi8(needle[0]);
+        const __m128i last = _mm_set1_epi8(needle[n - 1]);
+
+        for (; i + n - 1 + 16 <= len; i += 16) {
+            __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+            __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + n - 1));
+            unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                                _mm_cmpeq_epi8(block_last, last)));
+
+            while (mask != 0) {
+                unsigned int bit = __builtin_ctz(mask);
+
+                if (memcmp(haystack + i + bit + 1, needle + 1, n - 2) == 0) {
+                    return haystack + i + bit;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+    return memmem(haystack + i, len - i, needle, n);
+}
+
+/* Returns the end of the line starting at pos, or NULL if it runs to end.  In a binary
+ * file a NUL ends a line too.
+ */
+static const char *find_line_end(const char *pos, const char *end, bool binary)
+{
+    const char *line_end = memchr(pos, '\n', end - pos);
+    const char *nul;
+
+    if (binary) {
+        nul = memchr(pos, '\0', (line_end != NULL ? line_end : end) - pos);
+        if (nul != NULL) {
+            return nul;
+        }
+    }
+    return line_end;
+}
+
+/* Returns the first hit of any pattern at or after pos, or NULL.  hits holds the next hit
+ * of each pattern, NULL before the first search and end once it has no more, so a pattern
+ * is only searched for again once pos has passed its hit.
+ */
+static const char *find_any(const char *pos, const char *end, const char **hits)
+{
+    const char *first = end;
+    size_t i;
+
+    for (i = 0; i < npatterns; i++) {
+        if (hits[i] == NULL || (hits[i] != end && hits[i] < pos)) {
+            hits[i] = find(pos, end - pos, patterns[i].str, patterns[i].len);
+            if (hits[i] == NULL) {
+                hits[i] = end;
+            }
+        }
+        if (hits[i] < first) {
+            first = hits[i];
+        }
+    }
+    return first != end ? first : NULL;
+}
+
+/* Returns whether the line from pos to line_end matches any pattern */
+static bool line_matches(const char *pos, const char *line_end)
+{
+    regmatch_t match;
+    size_t i;
+
+    for (i = 0; i < npatterns; i++) {
+        match.rm_so = 0;
+        match.rm_eo = line_end - pos;
+        if (regexec(&search_regexes[i], pos, 1, &match, REG_STARTEND) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Counts the lines of data matching any pattern, like grep -c.  A last line without
+ * a newline counts too.  GNU grep treats a file containing a NUL as binary and from
+ * then on reads NULs as line ends, which changes the count, so binary does the same.
+ * grep only starts at the read buffer holding the first NUL, but no NUL comes before
+ * that one, so splitting the whole file on NULs gives the same lines.
+ */
+static unsigned long count_matching_lines(const char *data, size_t len, bool binary)
+{
+    const char *end = data + len;
+    const char *pos = data;
+    const char *line_end;
+    const char **hits = NULL;
+    unsigned long lines = 0;
+
+    if (!use_regex) {
+        hits = calloc(npatterns, sizeof(*hits));
+        if (hits == NULL) {
+            perror("finder: calloc");
+            exit(1);
+        }
+    }
+    while (pos < end) {
+        if (use_regex) {
+            line_end = find_line_end(pos, end, binary);
+            if (line_end == NULL) {
+                line_end = end;
+            }
+            if (line_matches(pos, line_end)) {
+                lines++;
+            }
+        } else {
+            const char *hit = find_any(pos, end, hits);
+
+            if (hit == NULL) {
+                break;
+            }
+            lines++;
+            line_end = find_line_end(hit, end, binary); // Patterns hold no NUL, so hit is on one line
+            if (line_end == NULL) {
+                break;
+            }
+        }
+        pos = line_end + 1;
+    }
+    free(hits);
+    return lines;
+}
+
+unsigned long finder_count_file(int dirfd, const char *path, const char *name)
+{
+    struct stat st;
+    unsigned long lines = 0;
+    void *data;
+    int fd;
+
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "finder: %s%s%s: %s\n", path ? path : "", path ? "/" : "", name, strerror(errno));
+    } else if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "finder: %s%s%s: %s\n", path ? path : "", path ? "/" : "", name, strerror(errno));
+        } else {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            lines = count_matching_lines(data, st.st_size, memchr(data, '\0', st.st_size) != NULL);
+            munmap(data, st.st_size);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return lines;
+}
+
+/* Counts a file of the plain search into the totals */
+static void search_file(int dirfd, const char *path, const char *name)
+{
+    unsigned long lines = finder_count_file(dirfd, path, name);
+
+    __atomic_fetch_add(&total_files, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total_lines, lines, __ATOMIC_RELAXED);
+}
+
+static void queue_push(char *dir)
+{
+    pthread_mutex_lock(&queue.lock);
+    if (queue.count == queue.capacity) {
+        queue.capacity = queue.capacity ? queue.capacity * 2 : 64;
+        queue.dirs = realloc(queue.dirs, queue.capacity * sizeof(*queue.dirs));
+        if (queue.dirs == NULL) {
+            perror("finder: realloc");
+            exit(1);
+        }
+    }
+    queue.dirs[queue.count++] = dir;
+    pthread_cond_signal(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/* Reads every entry of path, queueing subdirectories and visiting files */
+static void search_dir(char *path)
+{
+    char *buffer = malloc(DENTS_BUFFER_SIZE);
+    struct linux_dirent64 *entry;
+    struct stat st;
+    long nread;
+    long offset;
+    int dirfd;
+
+    dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (buffer == NULL || dirfd < 0) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+        free(buffer);
+        return;
+    }
+    while ((nread = syscall(SYS_getdents64, dirfd, buffer, DENTS_BUFFER_SIZE)) > 0) {
+        for (offset = 0; offset < nread; offset += entry->d_reclen) {
+            unsigned char type;
+
+            entry = (struct linux_dirent64 *)(buffer + offset);
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            type = entry->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                // Symlinks are followed to files, not directories, so the walk can't loop
+                if (fstatat(dirfd, entry->d_name, &st, 0) != 0) {
+                    continue;
+                }
+                type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) && type != DT_LNK ? DT_DIR : DT_UNKNOWN;
+            }
+            if (type == DT_DIR) {
+                char *subdir = malloc(strlen(path) + strlen(entry->d_name) + 2);
+
+                if (subdir == NULL) {
+                    perror("finder: malloc");
+                    exit(1);
+                }
+                sprintf(subdir, "%s/%s", path, entry->d_name);
+                queue_push(subdir);
+            } else if (type == DT_REG) {
+                visit_file(dirfd, path, entry->d_name);
+            }
+        }
+    }
+    if (nread < 0) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+    }
+    close(dirfd);
+    free(buffer);
+}
+
+static void *walk_worker(void *arg)
+{
+    char *dir;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0 && queue.busy > 0) {
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        }
+        if (queue.count == 0) {
+            // Nothing queued and nobody left to queue more, the walk is done
+            pthread_cond_broadcast(&queue.cond);
+            pthread_mutex_unlock(&queue.lock);
+            return NULL;
+        }
+        dir = queue.dirs[--queue.count];
+        queue.busy++;
+        pthread_mutex_unlock(&queue.lock);
+
+        search_dir(dir);
+        free(dir);
+
+        pthread_mutex_lock(&queue.lock);
+        queue.busy--;
+        if (queue.busy == 0 && queue.count == 0) {
+            pthread_cond_broadcast(&queue.cond);
+        }
+        pthread_mutex_unlock(&queue.lock);
+    }
+}
+
+void finder_parallel(void *(*fn)(void *), void *arg)
+{
+    pthread_t threads[MAX_THREADS];
+    unsigned int started;
+    unsigned int i;
+
+    for (started = 0; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, fn, arg) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        fn(arg);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void finder_walk(const char *root, finder_visit_fn visit)
+{
+    char *dir = strdup(root);
+
+    if (dir == NULL) {
+        perror("finder: strdup");
+        exit(1);
+    }
+    visit_file = visit;
+    queue_push(dir);
+    finder_parallel(walk_worker, NULL);
+}
+
+/* Returns whether str uses any grep basic regular expression syntax */
+static bool is_regex(const char *str)
+{
+    return strpbrk(str, "\\.[]*^$") != NULL;
+}
+
+/* Splits str into patterns at its newlines and compiles them if any uses regex syntax.
+ * Returns 0, or 2 if a pattern doesn't compile.
+ */
+static int parse_patterns(const char *str)
+{
+    char *copy = strdup(str);
+    char *line;
+    char *nl;
+    size_t i;
+    int rc;
+
+    npatterns = 1;
+    for (nl = strchr(str, '\n'); nl != NULL; nl = strchr(nl + 1, '\n')) {
+        npatterns++;
+    }
+    patterns = calloc(npatterns, sizeof(*patterns));
+    if (copy == NULL || patterns == NULL) {
+        perror("finder: malloc");
+        exit(1);
+    }
+    line = copy;
+    for (i = 0; i < npatterns; i++) {
+        nl = strchr(line, '\n');
+        if (nl != NULL) {
+            *nl = '\0';
+        }
+        patterns[i].str = line;
+        patterns[i].len = strlen(line);
+        use_regex |= is_regex(line);
+        line = nl + 1;
+    }
+
+    if (!use_regex) {
+        return 0;
+    }
+    search_regexes = calloc(npatterns, sizeof(*search_regexes));
+    if (search_regexes == NULL) {
+        perror("finder: calloc");
+        exit(1);
+    }
+    for (i = 0; i < npatterns; i++) {
+        if ((rc = regcomp(&search_regexes[i], patterns[i].str, REG_NOSUB)) != 0) {
+            char error[256];
+
+            regerror(rc, &search_regexes[i], error, sizeof(error));
+            fprintf(stderr, "finder: %s\n", error);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+static void free_patterns(void)
+{
+    size_t i;
+
+    if (use_regex) {
+        for (i = 0; i < npatterns; i++) {
+            regfree(&search_regexes[i]);
+        }
+        free(search_regexes);
+    }
+    free((char *)patterns[0].str); // The copy all patterns point into
+    free(patterns);
+}
+
+/* Counts files and matching lines under arg1 for search string arg2, printing the finder.sh report.
+ * -i indexfile searches through a trigram index kept in indexfile.
+ */
+int main(int argc, char *argv[])
+{
+    const char *index_path = NULL;
+    struct stat st;
+    long ncpus;
+    int opt;
+    int rc;
+
+    while ((opt = getopt(argc, argv, "+i:")) != -1) {
+        if (opt != 'i') {
+            return 1;
+        }
+        index_path = optarg;
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc != (NUM_PARAMS + 1)) {
+        printf("Incorrect number of parameters. Should be %d, was %d.\n", NUM_PARAMS, argc - 1);
+        printf("The first argument is a path to a directory on the filesystem.\n");
+        printf("The second argument is a text string to search for within those files.\n");
+        printf("Exiting...\n");
+        return 1;
+    }
+    if (stat(argv[1], &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("%s is not a valid directory.\n", argv[1]);
+        printf("Exiting...\n");
+        return 1;
+    }
+
+    if ((rc = parse_patterns(argv[2])) != 0) {
+        return rc;
+    }
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpus < 1 ? 1 : ncpus > MAX_THREADS ? MAX_THREADS : ncpus;
+    if (index_path != NULL) {
+        rc = finder_index_search(index_path, argv[1], &total_files, &total_lines);
+    } else {
+        finder_walk(argv[1], search_file);
+        rc = 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    printf("The number of files are %lu and the number of matching lines are %lu\n", total_files, total_lines);
+    free(queue.dirs);
+    free_patterns();
+    return 0;
+}
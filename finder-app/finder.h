@@ -0,0 +1,48 @@
+/* Shared parts of the native finder, see finder.c.
+ *
+ * For educational use only.
+ */
+
+#ifndef FINDER_H
+#define FINDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Called for every regular file of the tree, name is relative to dirfd which is the directory dir */
+typedef void (*finder_visit_fn)(int dirfd, const char *dir, const char *name);
+
+/* One line of the search string.  As in grep, a search string holding newlines is a list
+ * of patterns and a line matches if any of them does.
+ */
+struct finder_pattern {
+    const char *str; // NUL-terminated
+    size_t len;
+};
+
+/* The patterns of this run */
+extern struct finder_pattern *patterns;
+extern size_t npatterns;
+/* A pattern uses regex syntax, so they all have to go through regexec() */
+extern bool use_regex;
+
+/* Walks the tree under root with the worker threads, calling visit for each regular file.
+ * Hidden entries are skipped and symlinks to directories aren't followed.
+ */
+void finder_walk(const char *root, finder_visit_fn visit);
+
+/* Runs fn in each worker thread and waits for all of them to return */
+void finder_parallel(void *(*fn)(void *), void *arg);
+
+/* Counts the lines of file name in directory dirfd that contain searchstr, like grep -c.
+ * dir is only used in error messages, NULL when name is already the whole path.
+ */
+unsigned long finder_count_file(int dirfd, const char *dir, const char *name);
+
+/* Indexed search of the tree under root, updating the trigram index at index_path
+ * first.  Sets the number of files and matching lines.
+ * Returns 0, or 1 if the search could not be done.
+ */
+int finder_index_search(const char *index_path, const char *root, unsigned long *files, unsigned long *lines);
+
+#endif /* FINDER_H */
@@ -2,24 +2,63 @@
  * Author: Tim Bailey, tiba6275@colorado.edu
  * Date: 9/9/2023
  *
+ * Besides writing one file, writer can write many in one process from a
+ * manifest: writer -m manifest [-j jobs] [-s none|fdatasync|syncfs].
+ * See write_manifest() for the format.
+ *
  * For educational use only.
  */
- 
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #define NUM_PARAMS 2
+#define MAX_JOBS 64
+#define MAX_FILESYSTEMS 16
+
+enum sync_mode {
+    SYNC_NONE, // Leave writeback to the kernel, like fopen/fprintf did
+    SYNC_FDATASYNC, // fdatasync() each file before closing it
+    SYNC_SYNCFS, // One syncfs() per filesystem written to, once every file is written
+};
+
+struct record {
+    char *path;
+    char *content;
+    size_t len;
+};
+
+/* Shared by the writer threads of a manifest */
+struct manifest {
+    struct record *records;
+    size_t count;
+    size_t next; // Next record to write
+    enum sync_mode sync;
+    unsigned long failed;
+    pthread_mutex_t lock; // Protects the filesystem list
+    int fs_fds[MAX_FILESYSTEMS]; // A descriptor on each filesystem written to, for syncfs()
+    dev_t fs_devs[MAX_FILESYSTEMS];
+    unsigned int nfs;
+};
 
 /* Writes an input string to a file. Assumes directory is created by caller.
  * Exits and logs on file creation error.
- * Params: 
+ * Params:
  *   writefile - string location of file
  *   writestr - string to write to file
  * Returns:
  *   exits with 1 on file creation error
  */
-void write(char *writefile, char *writestr) {
+void write_file(char *writefile, char *writestr) {
     FILE *fp;
     fp = fopen(writefile, "w");
     if (fp != NULL) {
@@ -33,16 +72,262 @@ void write(char *writefile, char *writestr) {
     syslog(LOG_DEBUG, "%s written to %s.", writestr, writefile);
 }
 
-/* Writes arg2 to location arg1. Syslog debug and errors to LOG_USER. */
+/* Remembers the filesystem of fd for a later syncfs(), keeping a duplicate of fd open for it. */
+static void note_filesystem(struct manifest *m, int fd) {
+    struct stat st;
+    unsigned int i;
+
+    if (fstat(fd, &st) != 0) {
+        return;
+    }
+    pthread_mutex_lock(&m->lock);
+    for (i = 0; i < m->nfs && m->fs_devs[i] != st.st_dev; i++) {
+    }
+    if (i == m->nfs && m->nfs < MAX_FILESYSTEMS) {
+        m->fs_fds[m->nfs] = dup(fd);
+        if (m->fs_fds[m->nfs] >= 0) {
+            m->fs_devs[m->nfs++] = st.st_dev;
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+/* Writes one record with open/write, returns false and logs on error. */
+static bool write_record(struct manifest *m, const struct record *r) {
+    const char *p = r->content;
+    size_t left = r->len;
+    ssize_t n;
+    int fd;
+
+    fd = open(r->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Error creating file %s: %s", r->path, strerror(errno));
+        return false;
+    }
+    while (left > 0) {
+        n = write(fd, p, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            syslog(LOG_ERR, "Error writing file %s: %s", r->path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        p += n;
+        left -= n;
+    }
+    if (m->sync == SYNC_FDATASYNC && fdatasync(fd) != 0) {
+        syslog(LOG_ERR, "Error syncing file %s: %s", r->path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (m->sync == SYNC_SYNCFS) {
+        note_filesystem(m, fd);
+    }
+    if (close(fd) != 0) {
+        syslog(LOG_ERR, "Error closing file %s: %s", r->path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void *write_worker(void *arg) {
+    struct manifest *m = arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED)) < m->count) {
+        if (!write_record(m, &m->records[i])) {
+            __atomic_fetch_add(&m->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* Undoes the escapes of a manifest content field in place, returns its length. */
+static size_t unescape(char *s) {
+    char *out = s;
+    char *in;
+
+    for (in = s; *in != '\0'; in++) {
+        if (*in == '\\' && in[1] != '\0') {
+            in++;
+            *out++ = *in == 'n' ? '\n' : *in == 't' ? '\t' : *in;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return out - s;
+}
+
+/* Reads the records of a manifest, one per line: the path, a tab, then the content.
+ * In the content \n, \t and \\ stand for a newline, a tab and a backslash, and like
+ * writer's second argument it is written without a trailing newline.
+ * Returns the number of records, or -1 on error.
+ */
+static ssize_t read_manifest(FILE *fp, struct record **records) {
+    size_t capacity = 0;
+    size_t count = 0;
+    size_t line_size = 0;
+    char *line = NULL;
+    unsigned long lineno = 0;
+    ssize_t len;
+
+    *records = NULL;
+    while ((len = getline(&line, &line_size, fp)) >= 0) {
+        char *tab;
+
+        lineno++;
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        tab = strchr(line, '\t');
+        if (tab == NULL || tab == line) {
+            syslog(LOG_ERR, "Manifest line %lu is not a path, a tab and the content.", lineno);
+            fprintf(stderr, "Manifest line %lu is not a path, a tab and the content.\n", lineno);
+            free(line);
+            return -1;
+        }
+        *tab = '\0';
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            *records = realloc(*records, capacity * sizeof(**records));
+            if (*records == NULL) {
+                syslog(LOG_ERR, "Out of memory reading the manifest.");
+                free(line);
+                return -1;
+            }
+        }
+        // One allocation holds both fields
+        (*records)[count].path = line;
+        (*records)[count].content = tab + 1;
+        (*records)[count].len = unescape(tab + 1);
+        count++;
+        line = NULL;
+        line_size = 0;
+    }
+    free(line);
+    return count;
+}
+
+/* Writes every record of the manifest at path ("-" for stdin) with jobs threads.
+ * Returns 0, or 1 if the manifest couldn't be read or any file couldn't be written.
+ */
+static int write_manifest(const char *path, unsigned int jobs, enum sync_mode sync) {
+    pthread_t threads[MAX_JOBS];
+    struct manifest m;
+    unsigned int started;
+    unsigned int i;
+    ssize_t count;
+    FILE *fp;
+
+    fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (fp == NULL) {
+        syslog(LOG_ERR, "Error opening manifest %s: %s", path, strerror(errno));
+        return 1;
+    }
+    memset(&m, 0, sizeof(m));
+    count = read_manifest(fp, &m.records);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    if (count < 0) {
+        return 1;
+    }
+    m.count = count;
+    m.sync = sync;
+    pthread_mutex_init(&m.lock, NULL);
+
+    for (started = 0; started < jobs && started < m.count; started++) {
+        if (pthread_create(&threads[started], NULL, write_worker, &m) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        write_worker(&m);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < m.nfs; i++) {
+        if (syncfs(m.fs_fds[i]) != 0) {
+            syslog(LOG_ERR, "Error syncing filesystem: %s", strerror(errno));
+            m.failed++;
+        }
+        close(m.fs_fds[i]);
+    }
+    pthread_mutex_destroy(&m.lock);
+
+    printf("%lu files written, %lu failed.\n", m.count - m.failed, m.failed);
+    syslog(LOG_DEBUG, "%lu files written from manifest %s, %lu failed.", m.count - m.failed, path, m.failed);
+    for (i = 0; i < m.count; i++) {
+        free(m.records[i].path);
+    }
+    free(m.records);
+    return m.failed ? 1 : 0;
+}
+
+/* Writes arg2 to location arg1, or the files listed in the manifest given with -m.
+ * Syslog debug and errors to LOG_USER. */
 int main(int argc, char *argv[]) {
+    enum sync_mode sync = SYNC_NONE;
+    const char *manifest = NULL;
+    unsigned int jobs = 1;
+    int opt;
+    int rc;
+
     openlog("AESD A2", LOG_CONS | LOG_PID, LOG_USER);
-    
-    if (argc != (NUM_PARAMS + 1)) {
+
+    while ((opt = getopt(argc, argv, "+m:j:s:")) != -1) {
+        switch (opt) {
+        case 'm':
+            manifest = optarg;
+            break;
+        case 'j':
+            jobs = strtoul(optarg, NULL, 10);
+            if (jobs < 1 || jobs > MAX_JOBS) {
+                syslog(LOG_ERR, "Jobs must be between 1 and %d.", MAX_JOBS);
+                return(1);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "none") == 0) {
+                sync = SYNC_NONE;
+            } else if (strcmp(optarg, "fdatasync") == 0) {
+                sync = SYNC_FDATASYNC;
+            } else if (strcmp(optarg, "syncfs") == 0) {
+                sync = SYNC_SYNCFS;
+            } else {
+                syslog(LOG_ERR, "Unknown sync mode %s.", optarg);
+                return(1);
+            }
+            break;
+        default:
+            return(1);
+        }
+    }
+
+    if (manifest != NULL) {
+        if (optind != argc) {
+            syslog(LOG_ERR, "No other parameters allowed with a manifest.");
+            return(1);
+        }
+        rc = write_manifest(manifest, jobs, sync);
+        closelog();
+        return rc;
+    }
+
+    if (argc - optind != NUM_PARAMS) {
     	syslog(LOG_ERR, "Incorrect number of parameters, should be %d.", NUM_PARAMS);
         return(1);
     }
 
-    write(argv[1], argv[2]);
+    write_file(argv[optind], argv[optind + 1]);
 
     closelog();
 }
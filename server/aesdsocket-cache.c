@@ -0,0 +1,310 @@
+/*
+ * Userspace mirror of the aesdchar device contents, see aesdsocket-cache.h.
+ *
+ * The copy holds the device bytes from absolute offset base onward, as of
+ * ring generation generation.  Absolute offsets only ever grow and the bytes
+ * at an offset never change, so a stale copy stays a valid prefix of the
+ * device minus whatever was evicted since: a refill drops the evicted bytes
+ * from the front and reads only what was committed after the copy's end.
+ *
+ * Lock order: the device write mutex of aesdsocket.c, then cache.lock.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket-cache.h"
+#include "aesdsocket-trace.h"
+
+#define CACHE_REFILL_TRIES 3
+
+struct aesd_cache {
+    pthread_mutex_t lock;
+    int fd; // Our own descriptor for layout queries and refills, -1 when disabled
+    bool valid; // data is the device from base onward, complete as of generation
+    char *data; // Cached bytes start at data + start
+    size_t start;
+    size_t size;
+    size_t alloc;
+    uint64_t base; // Absolute device offset of the first cached byte
+    uint64_t generation;
+};
+
+static struct aesd_cache cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+/* Fills @param layout with the device's current layout, entry table not included */
+static int query_layout(struct aesd_layout *layout)
+{
+    memset(layout, 0, sizeof(*layout));
+    return ioctl(cache.fd, AESDCHAR_IOCLAYOUT, layout);
+}
+
+/* Makes room for @param extra more bytes after the cached data, returns false if out of memory */
+static bool cache_reserve(size_t extra)
+{
+    size_t needed = cache.size + extra;
+    size_t alloc;
+    char *data;
+
+    if (cache.start + needed <= cache.alloc) {
+        return true;
+    }
+    if (cache.start > 0) {
+        memmove(cache.data, cache.data + cache.start, cache.size);
+        cache.start = 0;
+        if (needed <= cache.alloc) {
+            return true;
+        }
+    }
+    alloc = cache.alloc ? cache.alloc : 4096;
+    while (alloc < needed) {
+        alloc *= 2;
+    }
+    data = realloc(cache.data, alloc);
+    if (data == NULL) {
+        return false;
+    }
+    cache.data = data;
+    cache.alloc = alloc;
+    return true;
+}
+
+/* Drops cached bytes before absolute offset @param base, which must not be past the cached end */
+static void cache_trim(uint64_t base)
+{
+    if (base > cache.base) {
+        cache.start += base - cache.base;
+        cache.size -= base - cache.base;
+        cache.base = base;
+    }
+    if (cache.size == 0) {
+        cache.start = 0;
+    }
+}
+
+void aesd_cache_init(const char *path)
+{
+    struct aesd_layout layout;
+
+    cache.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (cache.fd < 0) {
+        return;
+    }
+    if (query_layout(&layout) < 0) {
+        // Not an aesdchar device, or a driver without AESDCHAR_IOCLAYOUT
+        syslog(LOG_INFO, "Replay cache disabled: %s", strerror(errno));
+        close(cache.fd);
+        cache.fd = -1;
+    }
+}
+
+/*
+ * Brings the cache up to date with the device.  Reads only the bytes committed
+ * since the cached end, or the whole device if the copy no longer overlaps it.
+ * The layout is checked again after reading, so a commit racing with the read
+ * makes it try again.  Caller must hold cache.lock.
+ * @return true if the cache is valid
+ */
+static bool cache_refill(void)
+{
+    struct aesd_layout layout;
+    struct aesd_layout check;
+    uint64_t end;
+    uint64_t device_end;
+    size_t want;
+    size_t got;
+    ssize_t n;
+    int tries;
+
+    for (tries = 0; tries < CACHE_REFILL_TRIES; tries++) {
+        if (query_layout(&layout) < 0) {
+            break;
+        }
+        if (cache.valid && cache.generation == layout.generation) {
+            AESD_PROBE1(cache__hit, cache.size);
+            return true;
+        }
+
+        end = cache.base + cache.size;
+        device_end = layout.base_offset + layout.total_size;
+        if (cache.valid && layout.base_offset >= cache.base && layout.base_offset <= end && end <= device_end) {
+            cache_trim(layout.base_offset);
+        } else {
+            cache.start = 0;
+            cache.size = 0;
+            cache.base = layout.base_offset;
+            end = cache.base;
+        }
+
+        want = device_end - end;
+        if (!cache_reserve(want)) {
+            break;
+        }
+        for (got = 0; got < want; got += n) {
+            n = pread(cache.fd, cache.data + cache.start + cache.size + got, want - got, end - cache.base + got);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+        }
+        AESD_PROBE2(cache__refill, got, want);
+
+        if (query_layout(&check) < 0) {
+            break;
+        }
+        if (got == want && check.generation == layout.generation) {
+            cache.size += got;
+            cache.generation = layout.generation;
+            cache.valid = true;
+            return true;
+        }
+    }
+    cache.valid = false;
+    return false;
+}
+
+ssize_t aesd_cache_write(int fd, const char *buf, size_t size, struct aesd_cache_pending *pending)
+{
+    struct aesd_layout before;
+    struct aesd_layout after;
+    uint64_t grown;
+    uint64_t steps;
+    size_t committed = 0;
+    size_t ncmds = 0;
+    size_t i;
+    ssize_t written;
+    bool tracked;
+
+    if (cache.fd < 0) {
+        return write(fd, buf, size);
+    }
+
+    tracked = query_layout(&before) == 0;
+    written = write(fd, buf, size);
+    if (written <= 0) {
+        return written;
+    }
+
+    // Mirror the open file's partial entry to know which commands this write completes
+    if (pending->size + written > pending->alloc) {
+        size_t alloc = pending->alloc ? pending->alloc : 256;
+        char *data;
+
+        while (alloc < pending->size + written) {
+            alloc *= 2;
+        }
+        data = realloc(pending->data, alloc);
+        if (data == NULL) {
+            // Forget the fragment, the generation check below sends the cache back to the device
+            pending->size = 0;
+            tracked = false;
+        } else {
+            pending->data = data;
+            pending->alloc = alloc;
+        }
+    }
+    if (pending->size + written <= pending->alloc) {
+        memcpy(pending->data + pending->size, buf, written);
+        pending->size += written;
+    }
+    for (i = 0; i < pending->size; i++) {
+        if (pending->data[i] == '\n') {
+            committed = i + 1;
+            ncmds++;
+        }
+    }
+
+    tracked = tracked && query_layout(&after) == 0;
+    pthread_mutex_lock(&cache.lock);
+    /*
+     * Apply the write locally only if the cache was current before it and the
+     * device changed exactly as our commands alone would change it: the end
+     * moved by the committed bytes, and the generation by one step per
+     * command, two per command, or one more for an inline data reservation.
+     * Anything else, e.g. another process writing or a fragment left by a
+     * closed file being completed, is picked up from the device by the next refill.
+     */
+    if (tracked && cache.valid && cache.generation == before.generation) {
+        grown = after.base_offset + after.total_size - (before.base_offset + before.total_size);
+        steps = after.generation - before.generation;
+        if (grown == committed && (steps == ncmds || steps == ncmds + 1 || steps == 2 * ncmds) &&
+            cache_reserve(committed)) {
+            memcpy(cache.data + cache.start + cache.size, pending->data, committed);
+            cache.size += committed;
+            cache_trim(after.base_offset);
+            cache.generation = after.generation;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    memmove(pending->data, pending->data + committed, pending->size - committed);
+    pending->size -= committed;
+    return written;
+}
+
+ssize_t aesd_cache_send(int connfd, uint64_t pos, char **buffer, size_t *buffer_size)
+{
+    size_t len = 0;
+    size_t sent;
+    ssize_t n;
+
+    if (cache.fd < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    if (!cache_refill()) {
+        pthread_mutex_unlock(&cache.lock);
+        return -1;
+    }
+    // Copy out so a slow client doesn't hold up other replays and writes
+    if (pos < cache.size) {
+        len = cache.size - pos;
+        if (len > *buffer_size) {
+            char *grown = realloc(*buffer, len);
+
+            if (grown == NULL) {
+                pthread_mutex_unlock(&cache.lock);
+                return -1;
+            }
+            *buffer = grown;
+            *buffer_size = len;
+        }
+        memcpy(*buffer, cache.data + cache.start + pos, len);
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    for (sent = 0; sent < len; sent += n) {
+        n = send(connfd, *buffer + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+    }
+    return sent;
+}
+
+void aesd_cache_pending_free(struct aesd_cache_pending *pending)
+{
+    free(pending->data);
+    pending->data = NULL;
+    pending->size = 0;
+    pending->alloc = 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Userspace mirror of the aesdchar device contents for aesdsocket.
+ *
+ * Every complete packet makes aesdsocket send the whole device back to the
+ * client.  Instead of reading the device each time, the server keeps a copy
+ * of its contents, tagged with the ring generation and absolute offsets
+ * reported by AESDCHAR_IOCLAYOUT:
+ *  - After each of its own writes, the commands it just committed are
+ *    appended to the copy and evicted bytes dropped from its front, without
+ *    reading the device.
+ *  - Before serving a replay, the generation is checked.  If anything else
+ *    changed the device, such as another process writing to it, only the
+ *    bytes the copy is missing are read back, or everything if the copy no
+ *    longer overlaps the device.
+ *
+ * If the device doesn't support AESDCHAR_IOCLAYOUT, e.g. when writing to a
+ * regular file, the cache disables itself and every replay reads the device.
+ */
+
+#ifndef AESDSOCKET_CACHE_H
+#define AESDSOCKET_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bytes a connection wrote that don't end in a newline yet, so the device
+ * hasn't committed them.  Zero initialize, release with aesd_cache_pending_free().
+ */
+struct aesd_cache_pending {
+    char *data;
+    size_t size;
+    size_t alloc;
+};
+
+/**
+ * Opens a descriptor of its own on @param path for cache refills.
+ */
+void aesd_cache_init(const char *path);
+
+/**
+ * Writes @param size bytes from @param buf to the device through @param fd, updating the cache
+ * with the commands the write completes.  @param pending holds what the connection wrote before
+ * without a newline.  Callers serialize writes to the device, the cache relies on being told
+ * of every write this process makes.
+ * @return the result of write()
+ */
+ssize_t aesd_cache_write(int fd, const char *buf, size_t size, struct aesd_cache_pending *pending);
+
+/**
+ * Sends the device contents from file position @param pos onward to @param connfd, refilling
+ * the cache from the device first if it is stale.  @param buffer is a per-connection scratch
+ * buffer of *@param buffer_size bytes, grown as needed.
+ * @return the number of bytes sent, or -1 if the cache couldn't serve the replay and the
+ * caller should read the device instead
+ */
+ssize_t aesd_cache_send(int connfd, uint64_t pos, char **buffer, size_t *buffer_size);
+
+void aesd_cache_pending_free(struct aesd_cache_pending *pending);
+
+#endif /* AESDSOCKET_CACHE_H */
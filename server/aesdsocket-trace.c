@@ -0,0 +1,168 @@
+/*
+ * Built-in sampling tracer for aesdsocket, see aesdsocket-trace.h.
+ *
+ * Sampled packets are appended to a preallocated record buffer with a single
+ * atomic increment, so tracing never takes a lock or allocates on the packet
+ * path.  A record is published by setting its ready flag once it is filled
+ * in.  main writes the buffer out once, on exit, while connection threads may
+ * still be recording, so the dump skips records that aren't ready yet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "aesdsocket-trace.h"
+
+#define TRACE_DEFAULT_SAMPLE 100
+#define TRACE_MAX_RECORDS 65536
+
+struct trace_record {
+    bool ready; // Set with release ordering once tid and pkt are filled in
+    pid_t tid;
+    struct aesd_trace_packet pkt;
+};
+
+static const char *stage_names[AESD_TRACE_STAGES] = {
+    [AESD_TRACE_RECV] = "recv",
+    [AESD_TRACE_LOCK] = "mutex_wait",
+    [AESD_TRACE_WRITE] = "device_write",
+    [AESD_TRACE_IOCTL] = "seek_ioctl",
+    [AESD_TRACE_REPLAY] = "replay_send",
+};
+
+bool aesd_trace_enabled = false;
+static const char *trace_path;
+static unsigned long trace_sample = TRACE_DEFAULT_SAMPLE;
+static uint64_t trace_next_id;
+static struct trace_record *trace_records;
+static unsigned long trace_count;
+
+uint64_t aesd_trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void aesd_trace_init(void)
+{
+    const char *sample = getenv("AESDSOCKET_TRACE_SAMPLE");
+
+    trace_path = getenv("AESDSOCKET_TRACE");
+    if (trace_path == NULL || trace_path[0] == '\0') {
+        return;
+    }
+
+    if (sample != NULL && strtoul(sample, NULL, 10) > 0) {
+        trace_sample = strtoul(sample, NULL, 10);
+    }
+
+    trace_records = calloc(TRACE_MAX_RECORDS, sizeof(struct trace_record));
+    if (trace_records == NULL) {
+        syslog(LOG_ERR, "Failed to allocate trace buffer, tracing disabled");
+        return;
+    }
+
+    __atomic_store_n(&aesd_trace_enabled, true, __ATOMIC_RELAXED);
+    syslog(LOG_INFO, "Tracing 1 in %lu packets to %s", trace_sample, trace_path);
+}
+
+void aesd_trace_packet_begin(struct aesd_trace_packet *pkt)
+{
+    memset(pkt, 0, sizeof(*pkt));
+    if (!__atomic_load_n(&aesd_trace_enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pkt->id = __atomic_fetch_add(&trace_next_id, 1, __ATOMIC_RELAXED);
+    pkt->sampled = (pkt->id % trace_sample) == 0;
+}
+
+void aesd_trace_packet_end(struct aesd_trace_packet *pkt)
+{
+    unsigned long slot;
+
+    if (!pkt->sampled) {
+        return;
+    }
+
+    slot = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED);
+    if (slot >= TRACE_MAX_RECORDS) {
+        return; // Buffer full, drop the record
+    }
+
+    trace_records[slot].tid = syscall(SYS_gettid);
+    trace_records[slot].pkt = *pkt;
+    __atomic_store_n(&trace_records[slot].ready, true, __ATOMIC_RELEASE);
+}
+
+void aesd_trace_dump(void)
+{
+    unsigned long count = __atomic_load_n(&trace_count, __ATOMIC_RELAXED);
+    unsigned long i;
+    int stage;
+    bool first = true;
+    pid_t pid = getpid();
+    FILE *fp;
+
+    // Packets begun from now on aren't sampled, ones in flight may still claim slots
+    if (!__atomic_exchange_n(&aesd_trace_enabled, false, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    if (count > TRACE_MAX_RECORDS) {
+        count = TRACE_MAX_RECORDS;
+    }
+
+    fp = fopen(trace_path, "w");
+    if (fp == NULL) {
+        syslog(LOG_ERR, "Failed to open trace output %s", trace_path);
+        return;
+    }
+
+    // Chrome trace-event format, complete ("X") events with microsecond timestamps
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (i = 0; i < count; i++) {
+        struct trace_record *rec = &trace_records[i];
+        uint64_t begin = UINT64_MAX;
+        uint64_t end = 0;
+
+        if (!__atomic_load_n(&rec->ready, __ATOMIC_ACQUIRE)) {
+            continue; // Claimed by a packet still being recorded
+        }
+
+        for (stage = 0; stage < AESD_TRACE_STAGES; stage++) {
+            if (rec->pkt.start_ns[stage] == 0 || rec->pkt.end_ns[stage] == 0) {
+                continue;
+            }
+            if (rec->pkt.start_ns[stage] < begin) {
+                begin = rec->pkt.start_ns[stage];
+            }
+            if (rec->pkt.end_ns[stage] > end) {
+                end = rec->pkt.end_ns[stage];
+            }
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"packet\":%llu}}",
+                    first ? "" : ",", stage_names[stage], pid, rec->tid,
+                    rec->pkt.start_ns[stage] / 1000.0,
+                    (rec->pkt.end_ns[stage] - rec->pkt.start_ns[stage]) / 1000.0,
+                    (unsigned long long)rec->pkt.id);
+            first = false;
+        }
+
+        if (end == 0) {
+            continue;
+        }
+        fprintf(fp, "%s\n{\"name\":\"packet\",\"cat\":\"packet\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"packet\":%llu}}",
+                first ? "" : ",", pid, rec->tid, begin / 1000.0, (end - begin) / 1000.0,
+                (unsigned long long)rec->pkt.id);
+        first = false;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
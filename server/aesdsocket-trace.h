@@ -0,0 +1,109 @@
+/*
+ * Per-packet tracing for aesdsocket.
+ *
+ * Two independent mechanisms are provided:
+ *  - USDT (sys/sdt.h) static probes, which compile to a single nop when no
+ *    tracer is attached.  They are enabled automatically when sys/sdt.h is
+ *    available and can be disabled with -DAESD_NO_SDT.
+ *  - A built-in sampling tracer, enabled at runtime by setting the
+ *    AESDSOCKET_TRACE environment variable to an output path.  One packet in
+ *    AESDSOCKET_TRACE_SAMPLE (default 100) is timed stage by stage and the
+ *    collected spans are written on exit in Chrome trace-event JSON, which can
+ *    be loaded in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * List probes with: readelf -n aesdsocket | grep -A2 stapsdt
+ */
+
+#ifndef AESDSOCKET_TRACE_H
+#define AESDSOCKET_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if !defined(AESD_NO_SDT) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define AESD_HAVE_SDT 1
+#  endif
+#endif
+
+#ifdef AESD_HAVE_SDT
+#  define AESD_PROBE0(name)         DTRACE_PROBE(aesdsocket, name)
+#  define AESD_PROBE1(name, a)      DTRACE_PROBE1(aesdsocket, name, a)
+#  define AESD_PROBE2(name, a, b)   DTRACE_PROBE2(aesdsocket, name, a, b)
+#else
+#  define AESD_PROBE0(name)         do { } while (0)
+#  define AESD_PROBE1(name, a)      do { (void)(a); } while (0)
+#  define AESD_PROBE2(name, a, b)   do { (void)(a); (void)(b); } while (0)
+#endif
+
+/**
+ * Stages of a packet's life in connection_handler
+ */
+enum aesd_trace_stage {
+    AESD_TRACE_RECV,    // recv() from the client socket
+    AESD_TRACE_LOCK,    // waiting for the device write mutex
+    AESD_TRACE_WRITE,   // write() to the device
+    AESD_TRACE_IOCTL,   // AESDCHAR_IOCSEEKTO ioctl
+    AESD_TRACE_REPLAY,  // read() back from the device and send() to the client
+    AESD_TRACE_STAGES
+};
+
+/**
+ * Per-packet timing record, stack allocated by the connection handler.
+ * Timestamps are CLOCK_MONOTONIC nanoseconds, 0 for stages not visited.
+ */
+struct aesd_trace_packet {
+    bool sampled;
+    uint64_t id;
+    uint64_t start_ns[AESD_TRACE_STAGES];
+    uint64_t end_ns[AESD_TRACE_STAGES];
+};
+
+/**
+ * Set when the built-in tracer was enabled by aesd_trace_init(), cleared by
+ * aesd_trace_dump().  Access it with __atomic builtins.
+ */
+extern bool aesd_trace_enabled;
+
+/**
+ * Reads AESDSOCKET_TRACE and AESDSOCKET_TRACE_SAMPLE from the environment and,
+ * if tracing is requested, allocates the record buffer.
+ */
+void aesd_trace_init(void);
+
+/**
+ * Starts a new packet record in @param pkt and decides whether it is sampled.
+ */
+void aesd_trace_packet_begin(struct aesd_trace_packet *pkt);
+
+/**
+ * Stores a sampled @param pkt in the global record buffer.  Records are
+ * dropped once the buffer is full.
+ */
+void aesd_trace_packet_end(struct aesd_trace_packet *pkt);
+
+/**
+ * Stops sampling and writes the stored records as Chrome trace-event JSON to the
+ * AESDSOCKET_TRACE path.  Call it once, from normal thread context, not from a
+ * signal handler.  Records still being filled in by other threads are left out.
+ */
+void aesd_trace_dump(void);
+
+uint64_t aesd_trace_now_ns(void);
+
+static inline void aesd_trace_stage_begin(struct aesd_trace_packet *pkt, enum aesd_trace_stage stage)
+{
+    if (pkt->sampled) {
+        pkt->start_ns[stage] = aesd_trace_now_ns();
+    }
+}
+
+static inline void aesd_trace_stage_end(struct aesd_trace_packet *pkt, enum aesd_trace_stage stage)
+{
+    if (pkt->sampled) {
+        pkt->end_ns[stage] = aesd_trace_now_ns();
+    }
+}
+
+#endif /* AESDSOCKET_TRACE_H */
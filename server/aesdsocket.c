@@ -24,10 +24,16 @@
 #include <pthread.h>
 #include <time.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/sendfile.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket-trace.h"
+#include "aesdsocket-cache.h"
+#include "../examples/threading/prof-mutex.h"
 
 #define SERVER_PORT 9000
 #define BUFFER_SIZE 1024
+#define SENDFILE_CHUNK (64 * 1024)
 
 #define USE_AESD_CHAR_DEVICE 1
 
@@ -38,7 +44,8 @@
 #endif
 
 int sockfd;
-pthread_mutex_t mutex;
+volatile sig_atomic_t exit_requested; // Set by SIGINT and SIGTERM, main cleans up and exits
+struct prof_mutex mutex; // Serializes device writes, statistics written to AESDSOCKET_LOCK_STATS on SIGINT or SIGTERM
 typedef struct thread_node {
     pthread_t tid;
     struct thread_node *next;
@@ -48,15 +55,13 @@ node_t *head = NULL;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Signal handler to catch SIGINT and SIGTERM for graceful shutdown.
+// Shutting the listening socket down wakes main from accept(), which then
+// cleans up outside the handler.  The handler may run on a connection thread
+// that holds the write mutex, so it must not take it.
 void signal_handler(int signal) {
     if (signal == SIGINT || signal == SIGTERM) {
-        close(sockfd);
-        #if USE_AESD_CHAR_DEVICE != 1
-            remove(fdir);
-        #endif
-        syslog(LOG_INFO, "Caught signal, exiting");
-        closelog();
-        exit(0);
+        exit_requested = 1;
+        shutdown(sockfd, SHUT_RDWR);
     } else if (signal == SIGALRM) {
         #if USE_AESD_CHAR_DEVICE != 1
             char timestamp_str[100];
@@ -64,7 +69,7 @@ void signal_handler(int signal) {
             struct tm *local_time = localtime(&current_time);
             strftime(timestamp_str, sizeof(timestamp_str), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", local_time);
             
-            pthread_mutex_lock(&mutex);
+            prof_mutex_lock(&mutex);
             FILE *fp = fopen(fdir, "a");
             if (fp == NULL) {
                 perror("fopen: Failed opening file.");
@@ -72,15 +77,61 @@ void signal_handler(int signal) {
                 fprintf(fp, "%s", timestamp_str);
                 fclose(fp);
             }
-            pthread_mutex_unlock(&mutex);
+            prof_mutex_unlock(&mutex);
         #endif
     }
 }
 
+// Sends the device contents from file position pos onward to the client.
+// They come from the replay cache when it is usable.  Otherwise the data is
+// spliced straight from the device to the socket with sendfile(), falling
+// back to read()/send() if the device doesn't support splicing.
+static void replay(int connfd, int fd, off_t pos, char *buffer, char **cache_buffer, size_t *cache_buffer_size,
+                   struct aesd_trace_packet *pkt) {
+    ssize_t bytes_read = 0;
+    size_t total = 0;
+
+    aesd_trace_stage_begin(pkt, AESD_TRACE_REPLAY);
+    AESD_PROBE1(replay__start, connfd);
+    bytes_read = aesd_cache_send(connfd, pos, cache_buffer, cache_buffer_size);
+    if (bytes_read >= 0) {
+        AESD_PROBE2(replay__done, connfd, bytes_read);
+        aesd_trace_stage_end(pkt, AESD_TRACE_REPLAY);
+        return;
+    }
+    lseek(fd, pos, SEEK_SET);
+    while ((bytes_read = sendfile(connfd, fd, NULL, SENDFILE_CHUNK)) > 0) {
+        total += bytes_read;
+    }
+    if (bytes_read < 0 && total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+        while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
+            send(connfd, buffer, bytes_read, 0);
+            total += bytes_read;
+        }
+    }
+    AESD_PROBE2(replay__done, connfd, total);
+    aesd_trace_stage_end(pkt, AESD_TRACE_REPLAY);
+}
+
+// Writes the device write mutex statistics to the AESDSOCKET_LOCK_STATS path.
+static void dump_lock_stats(void) {
+    FILE *fp = fopen(getenv("AESDSOCKET_LOCK_STATS"), "w");
+
+    if (fp == NULL) {
+        syslog(LOG_ERR, "Failed to open AESDSOCKET_LOCK_STATS: %s", strerror(errno));
+        return;
+    }
+    prof_mutex_dump(&mutex, fp);
+    fclose(fp);
+}
+
 void *connection_handler(void *socket_desc) {
     int connfd = *(int *)socket_desc;
     char *buffer = calloc(BUFFER_SIZE, sizeof(char));
     int fd = open(fdir, O_RDWR); //Open the device file only once and use the same fd for IOCTL and reads
+    struct aesd_cache_pending pending = { 0 }; // This connection's unterminated command, for the replay cache
+    char *cache_buffer = NULL; // Replays are copied out of the cache into here
+    size_t cache_buffer_size = 0;
     
     if (fd < 0) {
         perror("open: Failed to open device.");
@@ -89,7 +140,20 @@ void *connection_handler(void *socket_desc) {
         return NULL;
     }
 
-    while (recv(connfd, buffer, BUFFER_SIZE, 0) > 0) {
+    for (;;) {
+        struct aesd_trace_packet pkt;
+        ssize_t received;
+
+        aesd_trace_packet_begin(&pkt);
+        aesd_trace_stage_begin(&pkt, AESD_TRACE_RECV);
+        AESD_PROBE1(recv__start, connfd);
+        received = recv(connfd, buffer, BUFFER_SIZE, 0);
+        AESD_PROBE2(recv__done, connfd, received);
+        aesd_trace_stage_end(&pkt, AESD_TRACE_RECV);
+        if (received <= 0) {
+            break;
+        }
+
         //Check for AESDCHAR_IOCSEEKTO
         if (strncmp(buffer, "AESDCHAR_IOCSEEKTO:", 19) == 0) {
             unsigned int write_cmd, write_cmd_offset;
@@ -99,37 +163,47 @@ void *connection_handler(void *socket_desc) {
                 seekto.write_cmd_offset = write_cmd_offset;
 
                 //Send IOCTL to driver
+                aesd_trace_stage_begin(&pkt, AESD_TRACE_IOCTL);
+                AESD_PROBE2(ioctl__start, write_cmd, write_cmd_offset);
                 int error = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
+                AESD_PROBE1(ioctl__done, error);
+                aesd_trace_stage_end(&pkt, AESD_TRACE_IOCTL);
                 if (error < 0) {
                     perror("ioctl: AESDCHAR_IOCSEEKTO failed");
                 } else {
                     //Read and send the content back over the socket
-                    uint32_t bytes_read = 0;
-                    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-                        send(connfd, buffer, bytes_read, 0);
-                    }
+                    replay(connfd, fd, lseek(fd, 0, SEEK_CUR), buffer, &cache_buffer, &cache_buffer_size, &pkt);
                 }
             } else {
                 syslog(LOG_ERR, "Failed to parse AESDCHAR_IOCSEEKTO command");
             }
         } else {
             //Write operation
-            pthread_mutex_lock(&mutex);
-            write(fd, buffer, strlen(buffer)); // Write to the device
-            pthread_mutex_unlock(&mutex);
+            aesd_trace_stage_begin(&pkt, AESD_TRACE_LOCK);
+            AESD_PROBE0(lock__wait);
+            prof_mutex_lock(&mutex);
+            AESD_PROBE0(lock__acquired);
+            aesd_trace_stage_end(&pkt, AESD_TRACE_LOCK);
+
+            aesd_trace_stage_begin(&pkt, AESD_TRACE_WRITE);
+            AESD_PROBE1(write__start, received);
+            ssize_t written = aesd_cache_write(fd, buffer, strlen(buffer), &pending); // Write to the device
+            AESD_PROBE1(write__done, written);
+            aesd_trace_stage_end(&pkt, AESD_TRACE_WRITE);
+            prof_mutex_unlock(&mutex);
             
             if (strchr(buffer, '\n') != NULL) {
-                lseek(fd, 0, SEEK_SET); //Reset the file position to the beginning of the file.
-                uint32_t bytes_read = 0;
-                while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-                    send(connfd, buffer, bytes_read, 0);
-                }
+                //Replay from the beginning of the file
+                replay(connfd, fd, 0, buffer, &cache_buffer, &cache_buffer_size, &pkt);
             }
         }
+        aesd_trace_packet_end(&pkt);
         memset(buffer, 0, BUFFER_SIZE);
     }
 
     free(buffer);
+    free(cache_buffer);
+    aesd_cache_pending_free(&pending);
     close(fd);
     close(connfd);
     return NULL;
@@ -185,10 +259,12 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    pthread_mutex_init(&mutex, NULL);
+    prof_mutex_init(&mutex, "device write", PROF_MUTEX_SPIN_PARK);
     
     // Initialize syslog for logging.
     openlog("aesdsocket", LOG_CONS | LOG_PID, LOG_USER);
+    aesd_trace_init();
+    aesd_cache_init(fdir);
     
     // Register the signal handler.
     signal(SIGINT, signal_handler);
@@ -244,14 +320,17 @@ int main(int argc, char *argv[]) {
     }
 
     // Main loop to accept client connections.
-    while (1) {
+    while (!exit_requested) {
         struct sockaddr_in client;
         socklen_t client_len = sizeof(client);
         int *new_sock = malloc(sizeof(int));
         int connfd = accept(sockfd, (struct sockaddr*)&client, &client_len);
         if (connfd < 0) {
-            perror("accept: Failed connecting to client.");
             free(new_sock);
+            if (exit_requested) {
+                break;
+            }
+            perror("accept: Failed connecting to client.");
             continue;
         }
 
@@ -276,16 +355,17 @@ int main(int argc, char *argv[]) {
 
     }
         
-    node_t *current = head;
-    while (current) {
-        pthread_join(current->tid, NULL);
-        node_t *to_free = current;
-        current = current->next;
-        free(to_free);
+    syslog(LOG_INFO, "Caught signal, exiting");
+
+    // Connection threads may be blocked on idle clients, so they aren't joined and exit() ends them.
+    // The write mutex stays initialized for them, a write in progress finishes before the dump.
+    // Packets they are still tracing are left out of the trace.
+    if (getenv("AESDSOCKET_LOCK_STATS") != NULL) {
+        dump_lock_stats();
     }
-    
+    aesd_trace_dump();
+
     // Cleanup
-    pthread_mutex_destroy(&mutex);
     timer_delete(timer_id);
     close(sockfd);
     #if USE_AESD_CHAR_DEVICE != 1